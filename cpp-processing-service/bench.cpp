@@ -0,0 +1,97 @@
+// PNG codec throughput. Decodes and re-encodes every image given on the
+// command line plus two synthetic photo-like images with each encode profile
+// and prints megabytes of RGBA pixels per second, best of a few rounds.
+// Build it with and without DEFLATE=libdeflate to compare the backends.
+#include "processing.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <png.h>
+#include <random>
+#include <string>
+#include <vector>
+
+constexpr int rounds = 3;
+constexpr const char *outputPath = "bench-output.png";
+
+// Smooth gradients with a little noise, compresses about as well as a photo
+std::string writeSyntheticImage(int width, int height) {
+  std::vector<png_byte> pixels(static_cast<size_t>(width) * height * 4);
+  std::mt19937 random(1);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      png_byte *pixel = &pixels[(static_cast<size_t>(y) * width + x) * 4];
+      int noise = random() % 8;
+      pixel[0] = (x * 255 / width + noise) & 255;
+      pixel[1] = (y * 255 / height + noise) & 255;
+      pixel[2] = ((x + y) * 127 / (width + height) + noise) & 255;
+      pixel[3] = 255;
+    }
+  }
+
+  std::string path =
+      "bench-" + std::to_string(width) + "x" + std::to_string(height) + ".png";
+  png_image image = {};
+  image.version = PNG_IMAGE_VERSION;
+  image.width = width;
+  image.height = height;
+  image.format = PNG_FORMAT_RGBA;
+  if (!png_image_write_to_file(&image, path.c_str(), 0, pixels.data(), 0, NULL)) {
+    fprintf(stderr, "Error: %s\n", image.message);
+    exit(1);
+  }
+  return path;
+}
+
+int main(int argc, char **argv) {
+  const char *workerThreads = getenv("WORKER_THREADS");
+  setWorkerThreads(workerThreads ? atoi(workerThreads) : 0);
+
+  std::vector<std::string> images(argv + 1, argv + argc);
+  std::vector<std::string> synthetic = {writeSyntheticImage(1024, 1024),
+                                        writeSyntheticImage(2048, 2048)};
+  images.insert(images.end(), synthetic.begin(), synthetic.end());
+
+  const PngEncodeProfile profiles[] = {PNG_ENCODE_FAST, PNG_ENCODE_BALANCED,
+                                       PNG_ENCODE_SMALLEST};
+  const char *profileNames[] = {"fast", "balanced", "smallest"};
+
+  printf("backend %s\n", pngDeflateBackend());
+  printf("%-24s %-9s %12s %12s %12s\n", "image", "profile", "decode MB/s",
+         "encode MB/s", "output KiB");
+  for (const std::string &image : images) {
+    for (int p = 0; p < 3; ++p) {
+      long long decodeMicros = 0;
+      long long encodeMicros = 0;
+      TranscodeReport report = {};
+      for (int round = 0; round < rounds; ++round) {
+        if (!transcodeImage(image.c_str(), outputPath, profiles[p], &report)) {
+          return 1;
+        }
+        if (round == 0 || report.decodeMicros < decodeMicros) {
+          decodeMicros = report.decodeMicros;
+        }
+        if (round == 0 || report.encodeMicros < encodeMicros) {
+          encodeMicros = report.encodeMicros;
+        }
+      }
+
+      FILE *output = fopen(outputPath, "rb");
+      long outputBytes = 0;
+      if (output) {
+        fseek(output, 0, SEEK_END);
+        outputBytes = ftell(output);
+        fclose(output);
+      }
+      double megabytes = static_cast<double>(report.width) * report.height * 4 / 1e6;
+      printf("%-24s %-9s %12.1f %12.1f %12ld\n", image.c_str(), profileNames[p],
+             megabytes * 1e6 / std::max(decodeMicros, 1LL),
+             megabytes * 1e6 / std::max(encodeMicros, 1LL), outputBytes / 1024);
+    }
+  }
+  remove(outputPath);
+  for (const std::string &image : synthetic) {
+    remove(image.c_str());
+  }
+  return 0;
+}
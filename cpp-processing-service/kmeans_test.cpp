@@ -0,0 +1,190 @@
+// Checks that brute force, Hamerly and Elkan assignment give the same
+// palette, iterations and output bytes for a fixed seed, ties included, and
+// which one runs for palettes around the Elkan limit: Elkan while its
+// colors x K bounds fit, Hamerly once they do not. Exits non-zero on the
+// first failed check.
+#include "processing.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <png.h>
+#include <string>
+#include <vector>
+
+constexpr int paletteSize = 256;
+
+// An RGBA PNG in memory of the given pixels
+std::vector<unsigned char> encodePng(int width, int height,
+                                     const std::vector<png_byte> &pixels) {
+  png_image image = {};
+  image.version = PNG_IMAGE_VERSION;
+  image.width = width;
+  image.height = height;
+  image.format = PNG_FORMAT_RGBA;
+  png_alloc_size_t size = 0;
+  png_image_write_to_memory(&image, NULL, &size, 0, pixels.data(), 0, NULL);
+  std::vector<unsigned char> png(size);
+  if (!png_image_write_to_memory(&image, png.data(), &size, 0, pixels.data(), 0,
+                                 NULL)) {
+    fprintf(stderr, "Error: %s\n", image.message);
+    exit(1);
+  }
+  png.resize(size);
+  return png;
+}
+
+// An RGBA PNG in memory whose pixels are all different colors
+std::vector<unsigned char> distinctColorsPng(int width, int height) {
+  std::vector<png_byte> pixels(static_cast<size_t>(width) * height * 4);
+  for (size_t i = 0; i < pixels.size() / 4; ++i) {
+    pixels[i * 4] = i & 255;
+    pixels[i * 4 + 1] = (i >> 8) & 255;
+    pixels[i * 4 + 2] = (i * 37) & 255;
+    pixels[i * 4 + 3] = 255;
+  }
+  return encodePng(width, height, pixels);
+}
+
+// An RGBA PNG in memory of a few gray levels an equal step apart, every
+// level between two centers is as far from one as from the other
+std::vector<unsigned char> evenStepsPng(int width, int height, int step) {
+  std::vector<png_byte> pixels(static_cast<size_t>(width) * height * 4);
+  for (size_t i = 0; i < pixels.size() / 4; ++i) {
+    png_byte level = (i % 9) * step;
+    pixels[i * 4] = level;
+    pixels[i * 4 + 1] = level;
+    pixels[i * 4 + 2] = level;
+    pixels[i * 4 + 3] = 255;
+  }
+  return encodePng(width, height, pixels);
+}
+
+// An RGBA PNG in memory of seeded noise, translucent too
+std::vector<unsigned char> noisePng(int width, int height) {
+  std::vector<png_byte> pixels(static_cast<size_t>(width) * height * 4);
+  unsigned state = 7;
+  for (auto &byte : pixels) {
+    state = state * 1103515245 + 12345;
+    byte = state >> 24;
+  }
+  return encodePng(width, height, pixels);
+}
+
+const char *assignmentName(KmeansAssignment assignment) {
+  switch (assignment) {
+  case KMEANS_ASSIGN_BRUTE_FORCE:
+    return "brute";
+  case KMEANS_ASSIGN_HAMERLY:
+    return "hamerly";
+  case KMEANS_ASSIGN_ELKAN:
+    return "elkan";
+  default:
+    return "auto";
+  }
+}
+
+int failures = 0;
+
+// Quantizes png with assignment and checks the one that ran, returns the output
+std::vector<unsigned char> expectAssignment(const char *name,
+                                            const std::vector<unsigned char> &png,
+                                            KmeansAssignment assignment,
+                                            KmeansAssignment expected) {
+  QuantizeOptions options = {};
+  options.maxIterations = 3;
+  options.assignment = assignment;
+  options.seed = 1;
+  ImageBuffer output = {};
+  QuantizeReport report = {};
+  std::vector<unsigned char> bytes;
+  if (!quantizeImageBuffer(png.data(), png.size(), paletteSize, &options, &output,
+                           &report)) {
+    printf("FAIL %s: quantize failed\n", name);
+    ++failures;
+  } else if (report.assignment != expected) {
+    printf("FAIL %s: ran %s, expected %s\n", name, assignmentName(report.assignment),
+           assignmentName(expected));
+    ++failures;
+  } else {
+    printf("ok   %s: %s\n", name, assignmentName(report.assignment));
+    bytes.assign(output.data, output.data + output.size);
+  }
+  freeImageBuffer(&output);
+  return bytes;
+}
+
+// Quantizes png to colors with every assignment and checks they agree
+void expectSameResult(const char *name, const std::vector<unsigned char> &png,
+                      int colors) {
+  const KmeansAssignment assignments[] = {KMEANS_ASSIGN_BRUTE_FORCE,
+                                          KMEANS_ASSIGN_HAMERLY,
+                                          KMEANS_ASSIGN_ELKAN};
+  std::vector<unsigned char> expected;
+  QuantizeReport expectedReport = {};
+  for (KmeansAssignment assignment : assignments) {
+    QuantizeOptions options = {};
+    options.maxIterations = 30;
+    options.assignment = assignment;
+    options.seed = 1;
+    ImageBuffer output = {};
+    QuantizeReport report = {};
+    bool quantized = quantizeImageBuffer(png.data(), png.size(), colors,
+                                         &options, &output, &report);
+    std::vector<unsigned char> bytes;
+    if (quantized) {
+      bytes.assign(output.data, output.data + output.size);
+    }
+    freeImageBuffer(&output);
+
+    if (!quantized || report.assignment != assignment) {
+      printf("FAIL %s: %s did not run\n", name, assignmentName(assignment));
+      ++failures;
+    } else if (assignment == KMEANS_ASSIGN_BRUTE_FORCE) {
+      expected = bytes;
+      expectedReport = report;
+    } else if (report.iterations != expectedReport.iterations ||
+               report.converged != expectedReport.converged) {
+      printf("FAIL %s: %s ran %d iterations, brute force %d\n", name,
+             assignmentName(assignment), report.iterations,
+             expectedReport.iterations);
+      ++failures;
+    } else if (bytes != expected) {
+      printf("FAIL %s: %s output differs from brute force\n", name,
+             assignmentName(assignment));
+      ++failures;
+    } else {
+      printf("ok   %s: %s matches brute force, %d iterations\n", name,
+             assignmentName(assignment), report.iterations);
+    }
+  }
+}
+
+int main() {
+  expectSameResult("distinct colors", distinctColorsPng(64, 32), 256);
+  expectSameResult("distinct colors, few centers", distinctColorsPng(64, 32), 7);
+  expectSameResult("noise", noisePng(48, 48), 32);
+  expectSameResult("equidistant levels", evenStepsPng(36, 36, 20), 4);
+  // 9 colors and 16 centers, seeding repeats the first center for the rest
+  expectSameResult("duplicate centers", evenStepsPng(36, 36, 20), 16);
+
+  // 2048 colors x 256 centers fit the Elkan bounds, 16384 x 256 do not
+  std::vector<unsigned char> small = distinctColorsPng(64, 32);
+  std::vector<unsigned char> large = distinctColorsPng(128, 128);
+
+  expectAssignment("elkan within the limit", small, KMEANS_ASSIGN_ELKAN,
+                   KMEANS_ASSIGN_ELKAN);
+  expectAssignment("auto within the limit", small, KMEANS_ASSIGN_AUTO,
+                   KMEANS_ASSIGN_ELKAN);
+  auto fallback = expectAssignment("elkan past the limit", large,
+                                   KMEANS_ASSIGN_ELKAN, KMEANS_ASSIGN_HAMERLY);
+  expectAssignment("auto past the limit", large, KMEANS_ASSIGN_AUTO,
+                   KMEANS_ASSIGN_HAMERLY);
+  auto hamerly = expectAssignment("hamerly past the limit", large,
+                                  KMEANS_ASSIGN_HAMERLY, KMEANS_ASSIGN_HAMERLY);
+
+  if (fallback != hamerly) {
+    printf("FAIL fallback output differs from hamerly\n");
+    ++failures;
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,244 @@
+// PNG decode and encode checks through the public API, outputs read back
+// with stock libpng: truncated input, the chunked encoder of large outputs,
+// palettes with alpha and every source color type. Exits non-zero on the
+// first failed check.
+#include "processing.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <png.h>
+#include <string>
+#include <vector>
+
+int failures = 0;
+
+void check(bool ok, const std::string &name) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", name.c_str());
+  if (!ok) {
+    ++failures;
+  }
+}
+
+std::vector<png_byte> noise(size_t size) {
+  std::vector<png_byte> bytes(size);
+  unsigned state = 1;
+  for (auto &byte : bytes) {
+    state = state * 1103515245 + 12345;
+    byte = state >> 24;
+  }
+  return bytes;
+}
+
+// A PNG in memory of pixels in format, colormap is used by the colormapped
+// formats only
+std::vector<unsigned char> encodePng(int width, int height, png_uint_32 format,
+                                     const std::vector<png_byte> &pixels,
+                                     const std::vector<png_byte> &colormap = {}) {
+  png_image image = {};
+  image.version = PNG_IMAGE_VERSION;
+  image.width = width;
+  image.height = height;
+  image.format = format;
+  image.colormap_entries = colormap.size() / PNG_IMAGE_SAMPLE_CHANNELS(format);
+  const void *map = colormap.empty() ? NULL : colormap.data();
+  png_alloc_size_t size = 0;
+  png_image_write_to_memory(&image, NULL, &size, 0, pixels.data(), 0, map);
+  std::vector<unsigned char> png(size);
+  if (!png_image_write_to_memory(&image, png.data(), &size, 0, pixels.data(), 0,
+                                 map)) {
+    fprintf(stderr, "Error: %s\n", image.message);
+    exit(1);
+  }
+  png.resize(size);
+  return png;
+}
+
+// A noisy RGBA PNG in memory
+std::vector<unsigned char> noisePng(int width, int height) {
+  return encodePng(width, height, PNG_FORMAT_RGBA,
+                   noise(static_cast<size_t>(width) * height * 4));
+}
+
+// png decoded by stock libpng to RGBA, empty when it fails. format gets the
+// format of the file itself.
+std::vector<png_byte> libpngRgba(const unsigned char *png, size_t size,
+                                 png_uint_32 *format = NULL) {
+  png_image image = {};
+  image.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_memory(&image, png, size)) {
+    return {};
+  }
+  if (format) {
+    *format = image.format;
+  }
+  image.format = PNG_FORMAT_RGBA;
+  std::vector<png_byte> pixels(PNG_IMAGE_SIZE(image));
+  if (!png_image_finish_read(&image, NULL, pixels.data(), 0, NULL)) {
+    return {};
+  }
+  return pixels;
+}
+
+// Resident memory of this process in KiB
+long residentKib() {
+  FILE *status = fopen("/proc/self/status", "r");
+  long kib = 0;
+  char line[256];
+  while (status && fgets(line, sizeof(line), status)) {
+    if (std::strncmp(line, "VmRSS:", 6) == 0) {
+      kib = atol(line + 6);
+    }
+  }
+  if (status) {
+    fclose(status);
+  }
+  return kib;
+}
+
+// A PNG cut off in its pixel data fails to decode, without keeping the
+// image it was decoding into
+void truncatedDecode() {
+  std::vector<unsigned char> png = noisePng(1024, 1024);
+  png.resize(png.size() / 2);
+
+  bool failed = true;
+  long before = 0;
+  for (int i = 0; i < 40; ++i) {
+    // The first few decodes settle the allocator, measure the rest
+    if (i == 8) {
+      before = residentKib();
+    }
+    ImageBuffer pixels = {};
+    int width = 0;
+    int height = 0;
+    failed = failed && !decodeImageBuffer(png.data(), png.size(), &pixels,
+                                          &width, &height);
+    freeImageBuffer(&pixels);
+  }
+  long grownKib = residentKib() - before;
+  check(failed, "truncated PNG fails to decode");
+  // 32 leaked 4 MiB images would be 128 MiB
+  printf("     resident memory grew %ld KiB over 32 decodes\n", grownKib);
+  check(grownKib < 16 * 1024, "truncated decodes free their image");
+}
+
+// An output past the chunked encoder threshold, encoded in parallel bands,
+// reads back as the pixels that went in
+void chunkedOutput() {
+  const int width = 1200;
+  const int height = 1000;
+  std::vector<png_byte> pixels = noise(static_cast<size_t>(width) * height * 4);
+  std::vector<unsigned char> png = encodePng(width, height, PNG_FORMAT_RGBA, pixels);
+
+  // Lanczos at the same size leaves every pixel as it is
+  ScaleOptions options = {};
+  options.filter = SCALE_FILTER_LANCZOS3;
+  ImageBuffer output = {};
+  bool scaled = scaleImageBuffer(png.data(), png.size(), width, height, &options,
+                                 &output, NULL);
+  check(scaled && libpngRgba(output.data, output.size) == pixels,
+        "chunked output reads back in stock libpng");
+  freeImageBuffer(&output);
+}
+
+// No more colors than the palette holds, translucent ones included, come
+// back exactly
+void paletteAlpha() {
+  const int width = 64;
+  const int height = 48;
+  std::vector<png_byte> pixels(static_cast<size_t>(width) * height * 4);
+  for (size_t i = 0; i < pixels.size() / 4; ++i) {
+    int color = i * 7 % 100;
+    pixels[i * 4] = color * 2;
+    pixels[i * 4 + 1] = 255 - color;
+    pixels[i * 4 + 2] = color % 10 * 25;
+    pixels[i * 4 + 3] = 15 + color % 5 * 60;
+  }
+  std::vector<unsigned char> png = encodePng(width, height, PNG_FORMAT_RGBA, pixels);
+
+  QuantizeOptions options = {};
+  options.seed = 1;
+  ImageBuffer output = {};
+  bool quantized = quantizeImageBuffer(png.data(), png.size(), 128, &options,
+                                       &output, NULL);
+  png_uint_32 format = 0;
+  std::vector<png_byte> decoded = libpngRgba(output.data, output.size, &format);
+  freeImageBuffer(&output);
+  check(quantized && (format & PNG_FORMAT_FLAG_COLORMAP) &&
+            (format & PNG_FORMAT_FLAG_ALPHA),
+        "palette output with alpha keeps a transparent palette");
+  check(decoded == pixels, "palette output with alpha reads back exactly");
+}
+
+// Every source color type scales to the same pixels as its RGBA expansion,
+// in a file of its own channels. Palettes become RGB or RGBA.
+void colorTypes() {
+  const int width = 90;
+  const int height = 60;
+  const size_t count = static_cast<size_t>(width) * height;
+  std::vector<png_byte> samples = noise(count * 4);
+  std::vector<png_byte> indices(count);
+  for (size_t i = 0; i < count; ++i) {
+    indices[i] = samples[i] % 16;
+  }
+  std::vector<png_byte> opaqueMap = noise(16 * 3);
+  std::vector<png_byte> translucentMap = noise(16 * 4);
+
+  struct Source {
+    const char *name;
+    std::vector<unsigned char> png;
+    png_uint_32 expected; // format of the scaled file
+  };
+  const Source sources[] = {
+      {"gray", encodePng(width, height, PNG_FORMAT_GRAY, samples),
+       PNG_FORMAT_GRAY},
+      {"gray and alpha", encodePng(width, height, PNG_FORMAT_GA, samples),
+       PNG_FORMAT_GA},
+      {"RGB", encodePng(width, height, PNG_FORMAT_RGB, samples), PNG_FORMAT_RGB},
+      {"RGBA", encodePng(width, height, PNG_FORMAT_RGBA, samples),
+       PNG_FORMAT_RGBA},
+      {"opaque palette",
+       encodePng(width, height, PNG_FORMAT_RGB_COLORMAP, indices, opaqueMap),
+       PNG_FORMAT_RGB},
+      {"translucent palette",
+       encodePng(width, height, PNG_FORMAT_RGBA_COLORMAP, indices, translucentMap),
+       PNG_FORMAT_RGBA},
+  };
+
+  for (ScaleFilter filter : {SCALE_FILTER_BOX, SCALE_FILTER_LANCZOS3}) {
+    ScaleOptions options = {};
+    options.filter = filter;
+    const char *filterName = filter == SCALE_FILTER_BOX ? "box" : "lanczos";
+    for (const Source &source : sources) {
+      std::vector<png_byte> rgba = libpngRgba(source.png.data(), source.png.size());
+      std::vector<unsigned char> reference =
+          encodePng(width, height, PNG_FORMAT_RGBA, rgba);
+
+      ImageBuffer output = {};
+      ImageBuffer expected = {};
+      bool scaled = scaleImageBuffer(source.png.data(), source.png.size(), 60,
+                                     40, &options, &output, NULL) &&
+                    scaleImageBuffer(reference.data(), reference.size(), 60, 40,
+                                     &options, &expected, NULL);
+      png_uint_32 format = 0;
+      std::vector<png_byte> pixels = libpngRgba(output.data, output.size, &format);
+      bool same = scaled && !pixels.empty() &&
+                  pixels == libpngRgba(expected.data, expected.size);
+      freeImageBuffer(&output);
+      freeImageBuffer(&expected);
+      check(same && format == source.expected,
+            std::string(filterName) + ": " + source.name +
+                " scales like its RGBA expansion");
+    }
+  }
+}
+
+int main() {
+  // Chunked encoding needs more than one thread
+  setWorkerThreads(4);
+  truncatedDecode();
+  chunkedOutput();
+  paletteAlpha();
+  colorTypes();
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+// Checks that the shared worker pool defaults to every core and that a large
+// request spreads over its threads: a banded Lanczos resize whose output is
+// big enough for the chunked encoder. Threads are told apart by the CPU time
+// the kernel accounts to each of them. Exits non-zero on the first failure.
+#include "processing.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <png.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Threads that ran more than this are counted as having done work
+constexpr long long busyNanos = 5000000;
+
+int failures = 0;
+
+void check(bool ok, const char *name) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+  if (!ok) {
+    ++failures;
+  }
+}
+
+// CPU time of every thread of this process but the calling one
+std::vector<long long> helperNanos() {
+  std::vector<long long> nanos;
+  DIR *tasks = opendir("/proc/self/task");
+  if (!tasks) {
+    return nanos;
+  }
+  std::string self = std::to_string(gettid());
+  while (dirent *entry = readdir(tasks)) {
+    if (entry->d_name[0] == '.' || self == entry->d_name) {
+      continue;
+    }
+    std::string path = std::string("/proc/self/task/") + entry->d_name + "/schedstat";
+    FILE *stat = fopen(path.c_str(), "r");
+    long long runNanos = 0;
+    if (stat && fscanf(stat, "%lld", &runNanos) == 1) {
+      nanos.push_back(runNanos);
+    }
+    if (stat) {
+      fclose(stat);
+    }
+  }
+  closedir(tasks);
+  return nanos;
+}
+
+// A noisy RGBA PNG in memory, noise keeps the encoder busy too
+std::vector<unsigned char> noisePng(int width, int height) {
+  std::vector<png_byte> pixels(static_cast<size_t>(width) * height * 4);
+  unsigned state = 1;
+  for (auto &byte : pixels) {
+    state = state * 1103515245 + 12345;
+    byte = state >> 24;
+  }
+  png_image image = {};
+  image.version = PNG_IMAGE_VERSION;
+  image.width = width;
+  image.height = height;
+  image.format = PNG_FORMAT_RGBA;
+  png_alloc_size_t size = 0;
+  png_image_write_to_memory(&image, NULL, &size, 0, pixels.data(), 0, NULL);
+  std::vector<unsigned char> png(size);
+  png_image_write_to_memory(&image, png.data(), &size, 0, pixels.data(), 0, NULL);
+  png.resize(size);
+  return png;
+}
+
+int main() {
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  check(workerThreads() == cores, "default pool has a thread per core");
+
+  // One core leaves nothing to spread over, prove it with four threads then
+  if (cores == 1) {
+    printf("     one core, checking the spread with four threads\n");
+    setWorkerThreads(4);
+  }
+  int threads = workerThreads();
+
+  std::vector<unsigned char> png = noisePng(2048, 2048);
+  ScaleOptions options = {};
+  options.filter = SCALE_FILTER_LANCZOS3;
+  ImageBuffer output = {};
+  check(scaleImageBuffer(png.data(), png.size(), 1800, 1800, &options, &output,
+                         NULL),
+        "large resize succeeds");
+  freeImageBuffer(&output);
+
+  std::vector<long long> nanos = helperNanos();
+  int busy = std::count_if(nanos.begin(), nanos.end(),
+                           [](long long n) { return n > busyNanos; });
+  printf("     %d of %d pool helpers did work\n", busy, threads - 1);
+  check(busy > 0, "large resize runs on more than one thread");
+  return failures == 0 ? 0 : 1;
+}
@@ -1,389 +1,4241 @@
 #include "processing.h"
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <immintrin.h>
+#include <initializer_list>
 #include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
 #include <string>
 #include <sys/types.h>
+#include <thread>
+#include <tuple>
+#include <unordered_set>
 #include <variant>
 #include <vector>
 
+#include <fcntl.h>
 #include <png.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 using Color = std::array<u_int8_t, 4>;
-using Mat = std::vector<std::vector<Color>>;
 using Error = std::string;
 using Success = bool;
+
+// Contiguous 8-bit image buffer.
+// Pixels are interleaved, `channels` bytes each, and every row starts
+// `stride` bytes after the previous one on a 64-byte boundary.
+// Copies and views share the same storage, use clone() for a deep copy.
+struct Mat {
+  static constexpr size_t rowAlignment = 64;
+
+  int width = 0;
+  int height = 0;
+  int channels = 0;
+  size_t stride = 0;
+
+  Mat() = default;
+  Mat(int width, int height, int channels = 4);
+
+  bool empty() const { return data == nullptr; }
+  u_int8_t *row(int y) { return data + y * stride; }
+  const u_int8_t *row(int y) const { return data + y * stride; }
+  u_int8_t *pixel(int x, int y) { return row(y) + x * channels; }
+  const u_int8_t *pixel(int x, int y) const { return row(y) + x * channels; }
+
+  // Sub-image sharing this image's storage, no pixels are copied
+  Mat view(int x, int y, int viewWidth, int viewHeight) const;
+  Mat clone() const;
+
+private:
+  std::shared_ptr<u_int8_t> storage;
+  u_int8_t *data = nullptr;
+};
+// Source area sampled by every pixel of a box resize
+struct BoxLayout {
+  int originalWidth = 0;
+  int originalHeight = 0;
+  int effectiveWidth = 0;
+  int effectiveHeight = 0;
+  int offsetX = 0;
+  int offsetY = 0;
+  float xRatio = 0;
+  float yRatio = 0;
+
+  int startX(int j) const { return static_cast<int>(j * xRatio); }
+  int startY(int i) const { return static_cast<int>(i * yRatio); }
+  int endX(int j) const {
+    return std::min(static_cast<int>((j + 1) * xRatio + 1), originalWidth);
+  }
+  int endY(int i) const {
+    return std::min(static_cast<int>((i + 1) * yRatio + 1), originalHeight);
+  }
+};
+
+// Encoder settings of one PNG write and the time it spent encoding
+struct PngEncoding {
+  PngEncodeProfile profile = PNG_ENCODE_BALANCED;
+  std::chrono::microseconds elapsed{0};
+};
+
+// Destination of an encoded PNG, a file or a buffer handed to the caller
+struct PngOutput {
+  const char *path = nullptr;    // created or truncated
+  ImageBuffer *buffer = nullptr; // used when path is NULL
+};
+
+// What an encode profile asks of zlib and the row filters
+struct DeflateSettings {
+  int level;
+  int strategy;
+  int filters; // PNG_FILTER_* flags, the one leaving the smallest row wins
+};
+
+// Everything but the pixels of a PNG written by ChunkedPngWriter
+struct PngLayout {
+  int width = 0;
+  int height = 0;
+  int bitDepth = 8;
+  int colorType = PNG_COLOR_TYPE_RGBA;
+  size_t rowBytes = 0;
+  int pixelBytes = 4; // distance of the Sub and Paeth filters
+  std::vector<png_color> palette;
+  std::vector<png_byte> alpha;
+};
+
+// PNG encoder for large images that deflates on every thread of the worker
+// pool, the way pigz does. Rows are buffered until every thread has a band
+// of them, then each band is filtered and deflated as a raw deflate stream
+// primed with the last 32 KiB of the band before it and closed with a sync
+// flush, so the bands join into one zlib stream. The zlib header goes in
+// front of the first band and the Adler-32 of the whole image, combined from
+// the per band checksums, after the last. Every band becomes one IDAT chunk,
+// any PNG decoder reads the result. Only one batch of bands is held at once.
+class ChunkedPngWriter {
+public:
+  ChunkedPngWriter(const PngLayout &layout, PngEncodeProfile profile);
+
+  // Writes the chunks ahead of the pixels to out, which stays the caller's
+  // to close
+  bool begin(FILE *out);
+  // Takes the next layout.rowBytes bytes of unfiltered row
+  void writeRow(const u_int8_t *row);
+  // Writes the rest of the image and adds the time spent encoding to
+  // encoding.elapsed. Any earlier failure is returned here.
+  std::variant<Success, Error> finish(PngEncoding &encoding);
+
+private:
+  void flush(bool last);
+  void fail(const Error &message);
+
+  PngLayout layout;
+  DeflateSettings settings;
+  int bandRows;
+  int batchRows;
+  FILE *fp = NULL;
+  std::vector<u_int8_t> rows;        // unfiltered rows of the current batch
+  std::vector<u_int8_t> previousRow; // last row of the batch before
+  std::vector<u_int8_t> window;      // filtered bytes of the band before
+  uLong adler;
+  bool startedStream = false;
+  Error error;
+  std::chrono::microseconds elapsed{0};
+};
+
+// Read-only view of a whole file, mapped so decoders read the page cache
+// directly. Files that cannot be mapped, pipes for one, are read into memory
+// instead. The file must not be truncated while it is mapped, outputs are
+// written through ReplacingFile so a view of the same path stays intact.
+class MappedFile {
+public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  // False when the file cannot be opened or read
+  bool open(const char *path);
+  const u_int8_t *data() const { return bytes; }
+  size_t size() const { return length; }
+
+private:
+  const u_int8_t *bytes = nullptr;
+  size_t length = 0;
+  bool mapped = false;
+  std::vector<u_int8_t> buffer;
+};
+
+// Output file written under a temporary name in the directory of its path
+// and renamed over that path by commit(), so the destination only ever holds
+// a whole image and may be the file being read. A file that is never
+// committed is removed again.
+class ReplacingFile {
+public:
+  ReplacingFile() = default;
+  ~ReplacingFile();
+  ReplacingFile(const ReplacingFile &) = delete;
+  ReplacingFile &operator=(const ReplacingFile &) = delete;
+
+  // False when the temporary file cannot be created
+  bool open(const char *path);
+  FILE *file() const { return fp; }
+  // Closes the file and renames it to the path, false when either fails
+  bool commit();
+
+private:
+  std::string path;
+  std::string temporaryPath;
+  FILE *fp = nullptr;
+};
+
+// PNG bytes libpng reads through readFromMemory
+struct PngReadCursor {
+  const u_int8_t *data;
+  size_t size;
+  size_t offset = 0;
+};
+
+// Running per-column channel totals of the source rows of one output row
+class BoxColumnSums {
+public:
+  BoxColumnSums(const BoxLayout &layout, int channels);
+  void clear();
+  void addRow(const u_int8_t *row);
+  void emitRow(u_int8_t *out);
+
+private:
+  template <int Channels> void emitPixels(u_int8_t *out);
+
+  BoxLayout layout;
+  int channels;
+  int rows = 0;
+  std::vector<u_int32_t> sums;
+  std::vector<unsigned long long> prefix;
+};
+
+// Source pixels behind every output pixel along one axis of a resample.
+// Output i is the sum of weights[i * taps + k] times source pixel
+// bounds[i] + k, in fixed point with resampleWeightBits fractional bits.
+// Every output takes the same number of taps, those past the filter weigh 0.
+struct ResampleTable {
+  int taps = 0;
+  std::vector<int> bounds;
+  std::vector<int16_t> weights;
+};
+
+// Distinct colors of an image, counts[i] pixels have colors[i]
+struct ColorHistogram {
+  std::vector<Color> colors;
+  std::vector<u_int32_t> counts;
+};
+
+// Quantized image as a palette of at most 256 colors and a 1-channel Mat of
+// palette indices. Translucent palette entries come first so the tRNS chunk
+// of a PNG only has to list those.
+struct IndexedImage {
+  Mat indices;
+  std::vector<Color> palette;
+};
+
+// Running total of the colors assigned to one k-means cluster
+struct ClusterSums {
+  std::array<unsigned long long, 4> sum = {0, 0, 0, 0};
+  unsigned long long count = 0;
+
+  void add(const Color &color, u_int32_t weight);
+};
+
+// Assignment step of k-means over a histogram. update() is called once per
+// iteration with the new centers, then assign() puts the index of the closest
+// center of colors [begin, end) in assignment, exactly what
+// findClosestCenterIndex would return, ties included. assign() may run for
+// disjoint ranges on several threads at once.
+class CenterAssigner {
+public:
+  virtual ~CenterAssigner() = default;
+  virtual void update(const std::vector<Color> &centers) = 0;
+  virtual void assign(std::vector<int> &assignment, size_t begin,
+                      size_t end) = 0;
+};
+
+// Picks the starting palette of at most K colors for an image from its
+// histogram, k-means may refine it afterwards
+class Quantizer {
+public:
+  virtual ~Quantizer() = default;
+  virtual std::vector<Color> palette(const ColorHistogram &histogram, int K) = 0;
+};
+
+// K-means centers in structure-of-arrays form for the vector kernels. Every
+// center is split into two 32-bit words holding R,G and B,A as 16-bit
+// halves, so one multiply-add gives the squared distance of two channels.
+class CenterTable {
+public:
+  explicit CenterTable(const std::vector<Color> &centers);
+
+  // indices[i] = findClosestCenterIndex(centers, pixel i) for `count`
+  // packed RGBA pixels
+  void nearest(const u_int8_t *pixels, size_t count, int *indices) const;
+
+private:
+  std::vector<int32_t> redGreen;
+  std::vector<int32_t> blueAlpha;
+};
+
+// Closest palette color of every pixel, for remapping images once the
+// palette is final. Large palettes go through a table of RGBA cells, the top
+// 5 bits of R, G and B and 4 of A. Every cell lists the only colors that can
+// be closest to a pixel inside it, ascending, so most pixels cost a table
+// load and a few distances, and the result still matches
+// findClosestCenterIndex, ties included. Cells are filled by prepare() for
+// the pixels of an image and kept, so the same map can remap more images to
+// the palette. Small palettes skip the table, the vector search over every
+// color is faster than filling it.
+class PaletteMap {
+public:
+  explicit PaletteMap(const std::vector<Color> &palette);
+
+  // Fills every cell a pixel of image falls in. Not safe to call while
+  // another thread uses the map.
+  void prepare(const Mat &image);
+  // indices[x] = closest palette index of the RGBA pixel x of row, every
+  // cell of the row must have been prepared
+  void nearest(const u_int8_t *row, int width, int *indices) const;
+
+private:
+  static constexpr std::array<int, 4> cellBits = {5, 5, 5, 4};
+
+  struct Cell {
+    u_int32_t offset = 0;
+    u_int32_t count = 0; // 0 until filled
+  };
+
+  static size_t cellOf(const u_int8_t *pixel);
+  void fillCell(size_t cell, std::vector<int32_t> &out) const;
+  int scanCell(const Cell &cell, const u_int8_t *pixel) const;
+
+  std::vector<Color> palette;
+  CenterTable table;
+  bool useCells;
+  // Cells listing more colors than this leave their pixels to the vector
+  // search over the whole palette
+  u_int32_t maxCellScan;
+  std::vector<Cell> cells;
+  std::vector<int32_t> candidates;
+};
+
+// Fixed set of threads shared by every request. parallelFor hands the
+// iterations of a loop to the workers and the calling thread works through
+// them too, so a call made with every worker busy still finishes.
+class WorkerPool {
+public:
+  explicit WorkerPool(int threads);
+  ~WorkerPool();
+
+  // Threads a loop can use, the caller included
+  int size() const { return static_cast<int>(workers.size()) + 1; }
+  // Runs body(i) for every i in [0, count) and returns when all are done,
+  // rethrowing the first exception body threw on any thread
+  void parallelFor(size_t count, const std::function<void(size_t)> &body);
+
+private:
+  void work();
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<std::function<void()>> queue;
+  bool stopping = false;
+};
+
 // Public API ###############################################################
+void setWorkerThreads(int threads);
+int workerThreads();
 bool scaleImage(const char *imagePath, const char *newImagePath, int newWidth, int newHeight);
+bool scaleImageWithOptions(const char *imagePath, const char *newImagePath,
+                           int newWidth, int newHeight,
+                           const ScaleOptions *options, ScaleReport *report);
 bool quantizeImage(const char *imagePath, const char *newImagePath, int N);
+bool quantizeImageWithOptions(const char *imagePath, const char *newImagePath,
+                              int N, const QuantizeOptions *options,
+                              QuantizeReport *report);
+bool scaleQuantizeImage(const char *imagePath, const char *scaledImagePath,
+                        const char *quantizedImagePath, int newWidth,
+                        int newHeight, int N, const ScaleOptions *scaleOptions,
+                        const QuantizeOptions *quantizeOptions,
+                        ScaleReport *scaleReport,
+                        QuantizeReport *quantizeReport);
+bool scaleImageLadder(const char *imagePath, const ScaleTarget *targets,
+                      int count, const ScaleOptions *options,
+                      ScaleReport *reports);
+const char *pngDeflateBackend();
+bool transcodeImage(const char *imagePath, const char *newImagePath,
+                    PngEncodeProfile encodeProfile, TranscodeReport *report);
+void freeImageBuffer(ImageBuffer *buffer);
+bool scaleImageBuffer(const unsigned char *png, size_t pngSize, int newWidth,
+                      int newHeight, const ScaleOptions *options,
+                      ImageBuffer *output, ScaleReport *report);
+bool quantizeImageBuffer(const unsigned char *png, size_t pngSize, int N,
+                         const QuantizeOptions *options, ImageBuffer *output,
+                         QuantizeReport *report);
+bool scaleQuantizeImageBuffer(const unsigned char *png, size_t pngSize,
+                              int newWidth, int newHeight, int N,
+                              const ScaleOptions *scaleOptions,
+                              const QuantizeOptions *quantizeOptions,
+                              ImageBuffer *scaledOutput,
+                              ImageBuffer *quantizedOutput,
+                              ScaleReport *scaleReport,
+                              QuantizeReport *quantizeReport);
+bool scaleImageLadderBuffer(const unsigned char *png, size_t pngSize,
+                            const ScaleTarget *targets, int count,
+                            const ScaleOptions *options, ImageBuffer *outputs,
+                            ScaleReport *reports);
+bool decodeImageBuffer(const unsigned char *png, size_t pngSize,
+                       ImageBuffer *rgba, int *width, int *height);
 // #########################################################################
 
 // Private API ##############################################################
+WorkerPool &workerPool();
 // K-means clustering algorithm
-void initializeCenter(Color &center, const Mat &image);
 int distanceSquared(const Color& a, const Color& b);
 size_t findClosestCenterIndex(const std::vector<Color>& centers, const Color& color);
-void updateCenter(Color& center, const std::vector<Color>& assignedColors);
-Color calculateMeanColor(const Mat& image, int startX, int startY, int endX, int endY);
-void runKmeans(Mat& image, int K, int N);
+using NearestCentersKernel = void (*)(const int32_t *redGreen,
+                                      const int32_t *blueAlpha, size_t K,
+                                      const u_int8_t *pixels, size_t count,
+                                      int *indices);
+void nearestCentersScalar(const int32_t *redGreen, const int32_t *blueAlpha,
+                          size_t K, const u_int8_t *pixels, size_t count,
+                          int *indices);
+void nearestCentersAvx2(const int32_t *redGreen, const int32_t *blueAlpha,
+                        size_t K, const u_int8_t *pixels, size_t count,
+                        int *indices);
+void nearestCentersAvx512(const int32_t *redGreen, const int32_t *blueAlpha,
+                          size_t K, const u_int8_t *pixels, size_t count,
+                          int *indices);
+NearestCentersKernel selectNearestCentersKernel();
+ColorHistogram buildColorHistogram(const Mat& image);
+std::vector<Color> seedCenters(const ColorHistogram& histogram, int K,
+                               unsigned int seed);
+KmeansAssignment resolveAssignment(KmeansAssignment method, size_t colors, int K);
+std::unique_ptr<CenterAssigner> makeCenterAssigner(KmeansAssignment method,
+                                                   const ColorHistogram& histogram,
+                                                   int K);
+void updateCenter(Color& center, const ClusterSums& cluster);
+QuantizeReport runKmeans(const ColorHistogram& histogram, std::vector<Color>& centers,
+                         int maxIterations, const QuantizeOptions& options);
+void parallelRows(int height, const std::function<void(int y)>& body);
+void remapImage(Mat& image, const std::vector<Color>& centers);
+IndexedImage indexImage(const Mat& image, const std::vector<Color>& centers);
+std::unique_ptr<Quantizer> makeQuantizer(const QuantizeOptions& options);
+QuantizeReport quantizeMat(const Mat& image, int K, const QuantizeOptions& options,
+                           std::vector<Color>& palette);
 // PNG file I/O - Depends on libpng
-std::variant<Mat, Error> readPng(const char *imagePath);
-std::variant<Success, Error> writePng(const char *imagePath, const Mat &image);
+void setDecodeTransforms(png_structp png, png_infop info, bool alpha, bool rgb);
+void readFromMemory(png_structp png, png_bytep out, png_size_t length);
+std::variant<Mat, Error> decodePng(const u_int8_t *bytes, size_t size, bool rgba);
+std::variant<Mat, Error> readPng(const char *imagePath, bool rgba);
+int pngColorType(int channels);
+DeflateSettings encodeSettings(PngEncodeProfile profile, bool palette);
+void setEncodeProfile(png_structp png, PngEncodeProfile profile, bool palette);
+bool useChunkedDeflate(size_t imageBytes);
+void filterRow(const u_int8_t *row, const u_int8_t *previous, size_t rowBytes,
+               int pixelBytes, int filters, u_int8_t *out);
+bool writeChunk(FILE *fp, const char *type,
+                std::initializer_list<std::pair<const void *, size_t>> parts);
+bool writePngHeader(FILE *fp, const PngLayout &layout);
+#ifdef USE_LIBDEFLATE
+bool unfilterRow(u_int8_t *row, const u_int8_t *previous, size_t rowBytes,
+                 int pixelBytes, int filter);
+Mat decodePngDeflate(const u_int8_t *bytes, size_t size, bool rgba);
+std::variant<Success, Error> writePngDeflate(
+    FILE *fp, const PngLayout &layout,
+    const std::function<const u_int8_t *(int y, u_int8_t *scratch)> &rows,
+    PngEncoding &encoding);
+#endif
+std::variant<Success, Error> writePng(FILE *fp, const Mat &image,
+                                      PngEncoding &encoding);
+int paletteBitDepth(size_t colors);
+std::variant<Success, Error> writeIndexedPng(FILE *fp,
+                                             const IndexedImage &image,
+                                             PngEncoding &encoding);
 // Image processing
-Mat resize(Mat image, int newWidth, int newHeight);
+BoxLayout computeBoxLayout(int originalWidth, int originalHeight, int newWidth, int newHeight);
+Mat resize(const Mat& image, int newWidth, int newHeight);
+Mat resizeWithLayout(const Mat& image, const BoxLayout& layout, int newWidth,
+                     int newHeight);
+size_t resizeBands(const BoxLayout& layout);
+double resampleFilterSupport(ScaleFilter filter);
+double resampleFilterWeight(ScaleFilter filter, double x);
+ResampleTable buildResampleTable(ScaleFilter filter, int inSize, int outSize);
+std::shared_ptr<const ResampleTable> resampleTable(ScaleFilter filter, int inSize,
+                                                   int outSize);
+using ResampleRowKernel = void (*)(const u_int8_t *source, u_int8_t *out,
+                                   const ResampleTable &table);
+using ResampleColumnKernel = void (*)(const u_int8_t *const *rows,
+                                      const int16_t *weights, int taps,
+                                      size_t bytes, u_int8_t *out);
+template <int Channels>
+void resampleRowScalar(const u_int8_t *source, u_int8_t *out,
+                       const ResampleTable &table);
+void resampleRowAvx2(const u_int8_t *source, u_int8_t *out,
+                     const ResampleTable &table);
+void resampleColumnScalar(const u_int8_t *const *rows, const int16_t *weights,
+                          int taps, size_t bytes, u_int8_t *out);
+void resampleColumnAvx2(const u_int8_t *const *rows, const int16_t *weights,
+                        int taps, size_t bytes, u_int8_t *out);
+ResampleRowKernel selectResampleRowKernel(int channels);
+ResampleColumnKernel selectResampleColumnKernel();
+Mat resampleWithLayout(const Mat& image, const BoxLayout& layout, int newWidth,
+                       int newHeight, ScaleFilter filter);
+Mat resample(const Mat& image, int newWidth, int newHeight, ScaleFilter filter);
+Mat padImage(const Mat& image, const BoxLayout& layout, int newWidth, int newHeight);
+Mat expandToRgba(const Mat& image);
+std::variant<Success, Error> scalePngStreaming(const char *imagePath,
+                                               const char *newImagePath,
+                                               int newWidth, int newHeight,
+                                               PngEncoding &encoding,
+                                               Mat *scaled);
+// Entry point plumbing
+unsigned char *reserveBuffer(ImageBuffer *buffer, size_t size);
+std::variant<Success, Error>
+writeOutput(const PngOutput &output,
+            const std::function<std::variant<Success, Error>(FILE *fp)> &write);
+bool scaleDecoded(std::variant<Mat, Error> &image, int newWidth, int newHeight,
+                  ScaleFilter filter, const PngOutput &output,
+                  PngEncoding &encoding, Mat *scaled);
+bool quantizeDecoded(std::variant<Mat, Error> &image, int N,
+                     const QuantizeOptions *options, const PngOutput &output,
+                     QuantizeReport *report);
+bool scaleLadderDecoded(std::variant<Mat, Error> &image, const ScaleTarget *targets,
+                        int count, const ScaleOptions *options,
+                        const std::vector<PngOutput> &outputs, ScaleReport *reports);
 // #########################################################################
 
-void initializeCenter(Color &center, const Mat &image) {
-  int width = image[0].size();
-  int height = image.size();
-  int x = std::rand() % width;
-  int y = std::rand() % height;
-  center = image[y][x];
+WorkerPool::WorkerPool(int threads) {
+  for (int i = 1; i < threads; ++i) {
+    workers.emplace_back(&WorkerPool::work, this);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void WorkerPool::work() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&] { return stopping || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      job = std::move(queue.front());
+      queue.pop_front();
+    }
+    job();
+  }
+}
+
+// Iterations of one parallelFor, claimed one at a time by whoever gets there
+// first. Workers that pick up their job after the loop is over find nothing
+// left and drop it, the shared_ptr keeps it alive until then. An exception
+// thrown by body is kept for the caller instead of escaping a worker, the
+// iterations left after it are counted without running.
+struct ParallelLoop {
+  std::atomic<size_t> next{0};
+  size_t count = 0;
+  const std::function<void(size_t)> *body = nullptr;
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t finished = 0;
+  std::atomic<bool> failed{false};
+  std::exception_ptr error; // The first one thrown, under mutex
+
+  void run() {
+    size_t ran = 0;
+    for (size_t i; (i = next++) < count; ++ran) {
+      if (failed) {
+        continue;
+      }
+      try {
+        (*body)(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        failed = true;
+      }
+    }
+    if (ran > 0) {
+      std::lock_guard<std::mutex> lock(mutex);
+      finished += ran;
+      if (finished == count) {
+        done.notify_all();
+      }
+    }
+  }
+};
+
+void WorkerPool::parallelFor(size_t count,
+                             const std::function<void(size_t)> &body) {
+  if (count <= 1 || workers.empty()) {
+    for (size_t i = 0; i < count; ++i) {
+      body(i);
+    }
+    return;
+  }
+
+  auto loop = std::make_shared<ParallelLoop>();
+  loop->count = count;
+  loop->body = &body;
+  size_t helpers = std::min(workers.size(), count - 1);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < helpers; ++i) {
+      queue.push_back([loop] { loop->run(); });
+    }
+  }
+  wake.notify_all();
+
+  // Every iteration is accounted for before an exception leaves, the
+  // workers hold body, which lives in the caller's frame
+  loop->run();
+  std::unique_lock<std::mutex> lock(loop->mutex);
+  loop->done.wait(lock, [&] { return loop->finished == count; });
+  if (loop->error) {
+    std::rethrow_exception(loop->error);
+  }
+}
+
+std::mutex workerPoolMutex;
+std::unique_ptr<WorkerPool> sharedWorkerPool;
+
+// Call before the first request, a running pool is not swapped out from
+// under the loops using it
+void setWorkerThreads(int threads) {
+  if (threads <= 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::lock_guard<std::mutex> lock(workerPoolMutex);
+  sharedWorkerPool = std::make_unique<WorkerPool>(threads);
+}
+
+WorkerPool &workerPool() {
+  std::lock_guard<std::mutex> lock(workerPoolMutex);
+  if (!sharedWorkerPool) {
+    sharedWorkerPool = std::make_unique<WorkerPool>(
+        std::max(1u, std::thread::hardware_concurrency()));
+  }
+  return *sharedWorkerPool;
+}
+
+int workerThreads() {
+  return workerPool().size();
+}
+
+Mat::Mat(int width, int height, int channels)
+    : width(width), height(height), channels(channels) {
+  size_t rowBytes = static_cast<size_t>(width) * channels;
+  stride = (rowBytes + rowAlignment - 1) / rowAlignment * rowAlignment;
+  size_t size = std::max<size_t>(stride * height, rowAlignment);
+  data = static_cast<u_int8_t *>(std::aligned_alloc(rowAlignment, size));
+  if (!data) {
+    throw std::bad_alloc();
+  }
+  // New images start fully transparent, which is also what resize pads with
+  std::memset(data, 0, size);
+  storage = std::shared_ptr<u_int8_t>(data, std::free);
+}
+
+Mat Mat::view(int x, int y, int viewWidth, int viewHeight) const {
+  Mat sub = *this;
+  sub.width = viewWidth;
+  sub.height = viewHeight;
+  sub.data = data + y * stride + x * channels;
+  return sub;
 }
 
+Mat Mat::clone() const {
+  Mat copy(width, height, channels);
+  for (int y = 0; y < height; ++y) {
+    std::memcpy(copy.row(y), row(y), static_cast<size_t>(width) * channels);
+  }
+  return copy;
+}
 
 int distanceSquared(const Color& a, const Color& b) {
     int distance = 0;
     for (int i = 0; i < 4; ++i) {
         distance += (a[i] - b[i]) * (a[i] - b[i]);
     }
-    return distance;
-}
+    return distance;
+}
+
+// Find the index of the closest center to a given color
+size_t findClosestCenterIndex(const std::vector<Color>& centers, const Color& color) {
+    int minDistance = std::numeric_limits<int>::max();
+    size_t index = 0;
+    for (size_t i = 0; i < centers.size(); ++i) {
+        int dist = distanceSquared(color, centers[i]);
+        if (dist < minDistance) {
+            minDistance = dist;
+            index = i;
+        }
+    }
+    return index;
+}
+
+// R,G or B,A of a center or pixel as the two 16-bit halves of a word
+int32_t packChannelPair(u_int8_t low, u_int8_t high) {
+    return static_cast<int32_t>(low) | (static_cast<int32_t>(high) << 16);
+}
+
+CenterTable::CenterTable(const std::vector<Color>& centers) {
+    redGreen.reserve(centers.size());
+    blueAlpha.reserve(centers.size());
+    for (const auto& center : centers) {
+        redGreen.push_back(packChannelPair(center[0], center[1]));
+        blueAlpha.push_back(packChannelPair(center[2], center[3]));
+    }
+}
+
+void CenterTable::nearest(const u_int8_t* pixels, size_t count, int* indices) const {
+    static const NearestCentersKernel kernel = selectNearestCentersKernel();
+    kernel(redGreen.data(), blueAlpha.data(), redGreen.size(), pixels, count, indices);
+}
+
+int pairDistanceSquared(int32_t a, int32_t b) {
+    int low = (a & 0xFFFF) - (b & 0xFFFF);
+    int high = (a >> 16) - (b >> 16);
+    return low * low + high * high;
+}
+
+void nearestCentersScalar(const int32_t* redGreen, const int32_t* blueAlpha,
+                          size_t K, const u_int8_t* pixels, size_t count,
+                          int* indices) {
+    for (size_t i = 0; i < count; ++i) {
+        const u_int8_t* px = pixels + i * 4;
+        int32_t rg = packChannelPair(px[0], px[1]);
+        int32_t ba = packChannelPair(px[2], px[3]);
+        int minDistance = std::numeric_limits<int>::max();
+        int index = 0;
+        for (size_t j = 0; j < K; ++j) {
+            int dist = pairDistanceSquared(rg, redGreen[j]) +
+                       pairDistanceSquared(ba, blueAlpha[j]);
+            if (dist < minDistance) {
+                minDistance = dist;
+                index = j;
+            }
+        }
+        indices[i] = index;
+    }
+}
+
+// The vector kernels take 8 or 16 pixels at a time and walk the centers in
+// order, a lane only moves to a later center when it is strictly closer, so
+// ties go to the lowest index exactly like the scalar search.
+// Byte shuffles splitting RGBA pixels into zero extended R,G and B,A pairs,
+// the same for every 128-bit lane
+alignas(64) const u_int32_t redGreenShuffle[16] = {
+    0x80018000, 0x80058004, 0x80098008, 0x800D800C,
+    0x80018000, 0x80058004, 0x80098008, 0x800D800C,
+    0x80018000, 0x80058004, 0x80098008, 0x800D800C,
+    0x80018000, 0x80058004, 0x80098008, 0x800D800C};
+alignas(64) const u_int32_t blueAlphaShuffle[16] = {
+    0x80038002, 0x80078006, 0x800B800A, 0x800F800E,
+    0x80038002, 0x80078006, 0x800B800A, 0x800F800E,
+    0x80038002, 0x80078006, 0x800B800A, 0x800F800E,
+    0x80038002, 0x80078006, 0x800B800A, 0x800F800E};
+
+__attribute__((target("avx2")))
+void nearestCentersAvx2(const int32_t* redGreen, const int32_t* blueAlpha,
+                        size_t K, const u_int8_t* pixels, size_t count,
+                        int* indices) {
+    const __m256i toRedGreen =
+        _mm256_load_si256(reinterpret_cast<const __m256i*>(redGreenShuffle));
+    const __m256i toBlueAlpha =
+        _mm256_load_si256(reinterpret_cast<const __m256i*>(blueAlphaShuffle));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i * 4));
+        __m256i rg = _mm256_shuffle_epi8(px, toRedGreen);
+        __m256i ba = _mm256_shuffle_epi8(px, toBlueAlpha);
+        __m256i best = _mm256_set1_epi32(std::numeric_limits<int>::max());
+        __m256i bestIndex = _mm256_setzero_si256();
+        for (size_t j = 0; j < K; ++j) {
+            __m256i dRG = _mm256_sub_epi16(rg, _mm256_set1_epi32(redGreen[j]));
+            __m256i dBA = _mm256_sub_epi16(ba, _mm256_set1_epi32(blueAlpha[j]));
+            __m256i dist = _mm256_add_epi32(_mm256_madd_epi16(dRG, dRG),
+                                            _mm256_madd_epi16(dBA, dBA));
+            __m256i closer = _mm256_cmpgt_epi32(best, dist);
+            best = _mm256_blendv_epi8(best, dist, closer);
+            bestIndex = _mm256_blendv_epi8(bestIndex, _mm256_set1_epi32(j), closer);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(indices + i), bestIndex);
+    }
+    nearestCentersScalar(redGreen, blueAlpha, K, pixels + i * 4, count - i, indices + i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void nearestCentersAvx512(const int32_t* redGreen, const int32_t* blueAlpha,
+                          size_t K, const u_int8_t* pixels, size_t count,
+                          int* indices) {
+    const __m512i toRedGreen = _mm512_load_si512(redGreenShuffle);
+    const __m512i toBlueAlpha = _mm512_load_si512(blueAlphaShuffle);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512i px = _mm512_loadu_si512(pixels + i * 4);
+        __m512i rg = _mm512_shuffle_epi8(px, toRedGreen);
+        __m512i ba = _mm512_shuffle_epi8(px, toBlueAlpha);
+        __m512i best = _mm512_set1_epi32(std::numeric_limits<int>::max());
+        __m512i bestIndex = _mm512_setzero_si512();
+        for (size_t j = 0; j < K; ++j) {
+            __m512i dRG = _mm512_sub_epi16(rg, _mm512_set1_epi32(redGreen[j]));
+            __m512i dBA = _mm512_sub_epi16(ba, _mm512_set1_epi32(blueAlpha[j]));
+            __m512i dist = _mm512_add_epi32(_mm512_madd_epi16(dRG, dRG),
+                                            _mm512_madd_epi16(dBA, dBA));
+            __mmask16 closer = _mm512_cmplt_epi32_mask(dist, best);
+            best = _mm512_mask_mov_epi32(best, closer, dist);
+            bestIndex = _mm512_mask_mov_epi32(bestIndex, closer, _mm512_set1_epi32(j));
+        }
+        _mm512_storeu_si512(indices + i, bestIndex);
+    }
+    nearestCentersAvx2(redGreen, blueAlpha, K, pixels + i * 4, count - i, indices + i);
+}
+
+NearestCentersKernel selectNearestCentersKernel() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        return nearestCentersAvx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return nearestCentersAvx2;
+    }
+    return nearestCentersScalar;
+}
+
+// Collapse the image into its distinct colors and their pixel counts
+ColorHistogram buildColorHistogram(const Mat& image) {
+    std::vector<u_int32_t> packed(static_cast<size_t>(image.width) * image.height);
+    size_t n = 0;
+    for (int y = 0; y < image.height; ++y) {
+        const u_int8_t* row = image.row(y);
+        for (int x = 0; x < image.width; ++x) {
+            std::memcpy(&packed[n++], row + x * image.channels, sizeof(u_int32_t));
+        }
+    }
+    std::sort(packed.begin(), packed.end());
+
+    ColorHistogram histogram;
+    for (size_t i = 0; i < packed.size();) {
+        size_t j = i + 1;
+        while (j < packed.size() && packed[j] == packed[i]) {
+            ++j;
+        }
+        Color color;
+        std::memcpy(color.data(), &packed[i], color.size());
+        histogram.colors.push_back(color);
+        histogram.counts.push_back(static_cast<u_int32_t>(j - i));
+        i = j;
+    }
+    return histogram;
+}
+
+// Colors per band of a parallel k-means iteration and rows per band of the
+// final remap, small enough to keep every thread of the pool busy
+constexpr size_t kmeansBandColors = 4096;
+constexpr int remapBandRows = 32;
+
+// Index of the entry where the running total of weights first passes target
+size_t pickWeighted(const std::vector<unsigned long long>& weights,
+                    unsigned long long target) {
+    size_t i = 0;
+    while (i + 1 < weights.size() && target >= weights[i]) {
+        target -= weights[i++];
+    }
+    return i;
+}
+
+// k-means++ over the histogram: the first center is a pixel picked at random
+// and every next one a color picked with probability proportional to its
+// pixel count times its squared distance to the closest center so far.
+// Weights are integers and the generator is local, so the same seed always
+// gives the same centers whatever the thread count or other requests do.
+std::vector<Color> seedCenters(const ColorHistogram& histogram, int K,
+                               unsigned int seed) {
+    const size_t colorCount = histogram.colors.size();
+    std::mt19937_64 rng(seed);
+    std::vector<Color> centers;
+    centers.reserve(K);
+
+    std::vector<unsigned long long> weights(histogram.counts.begin(),
+                                            histogram.counts.end());
+    unsigned long long pixels = 0;
+    for (auto count : weights) {
+        pixels += count;
+    }
+    centers.push_back(histogram.colors[pickWeighted(
+        weights, std::uniform_int_distribution<unsigned long long>(0, pixels - 1)(rng))]);
+
+    std::vector<int> closest(colorCount, std::numeric_limits<int>::max());
+    WorkerPool& pool = workerPool();
+    size_t bands = (colorCount + kmeansBandColors - 1) / kmeansBandColors;
+    std::vector<unsigned long long> bandTotals(bands);
+    while (static_cast<int>(centers.size()) < K) {
+        const Color& last = centers.back();
+        pool.parallelFor(bands, [&](size_t band) {
+            size_t begin = band * kmeansBandColors;
+            size_t end = std::min(begin + kmeansBandColors, colorCount);
+            unsigned long long total = 0;
+            for (size_t i = begin; i < end; ++i) {
+                closest[i] = std::min(closest[i], distanceSquared(histogram.colors[i], last));
+                weights[i] = static_cast<unsigned long long>(closest[i]) * histogram.counts[i];
+                total += weights[i];
+            }
+            bandTotals[band] = total;
+        });
+        unsigned long long total = 0;
+        for (auto bandTotal : bandTotals) {
+            total += bandTotal;
+        }
+
+        // Fewer distinct colors than K, the rest repeat the first center
+        if (total == 0) {
+            centers.resize(K, centers.front());
+            break;
+        }
+        centers.push_back(histogram.colors[pickWeighted(
+            weights, std::uniform_int_distribution<unsigned long long>(0, total - 1)(rng))]);
+    }
+    return centers;
+}
+
+class BruteForceAssigner : public CenterAssigner {
+public:
+    explicit BruteForceAssigner(const ColorHistogram& histogram)
+        : histogram(histogram), table(std::vector<Color>()) {}
+
+    void update(const std::vector<Color>& centers) override {
+        table = CenterTable(centers);
+    }
+
+    void assign(std::vector<int>& assignment, size_t begin, size_t end) override {
+        table.nearest(histogram.colors[begin].data(), end - begin, &assignment[begin]);
+    }
+
+private:
+    const ColorHistogram& histogram;
+    CenterTable table;
+};
+
+// Bounds are kept on real (not squared) distances, so they obey the triangle
+// inequality. A color is only skipped when a bound proves its center strictly
+// closer than any other, with some slack for the floating point error the
+// bounds pick up as the centers move.
+constexpr double boundSlack = 1e-6;
+
+double centerDistance(const Color& a, const Color& b) {
+    return std::sqrt(static_cast<double>(distanceSquared(a, b)));
+}
+
+// How far every center moved since the last iteration
+std::vector<double> centerDrift(const std::vector<Color>& previous,
+                                const std::vector<Color>& centers) {
+    std::vector<double> drift(centers.size(), 0.0);
+    if (previous.size() == centers.size()) {
+        for (size_t j = 0; j < centers.size(); ++j) {
+            drift[j] = centerDistance(previous[j], centers[j]);
+        }
+    }
+    return drift;
+}
+
+// Half the distance from every center to its nearest other center
+std::vector<double> halfNearestCenterDistance(const std::vector<Color>& centers) {
+    std::vector<double> half(centers.size(), std::numeric_limits<double>::max());
+    for (size_t j = 0; j < centers.size(); ++j) {
+        for (size_t k = j + 1; k < centers.size(); ++k) {
+            double d = 0.5 * centerDistance(centers[j], centers[k]);
+            half[j] = std::min(half[j], d);
+            half[k] = std::min(half[k], d);
+        }
+    }
+    return half;
+}
+
+// Hamerly's algorithm, an upper bound on the distance to the assigned center
+// and a lower bound on the distance to every other center per color
+class HamerlyAssigner : public CenterAssigner {
+public:
+    explicit HamerlyAssigner(const ColorHistogram& histogram)
+        : histogram(histogram), upper(histogram.colors.size()),
+          lower(histogram.colors.size()) {}
+
+    void update(const std::vector<Color>& newCenters) override {
+        drift = centerDrift(centers, newCenters);
+        half = halfNearestCenterDistance(newCenters);
+        firstPass = centers.empty();
+        centers = newCenters;
+
+        // The two largest drifts, a color's lower bound shrinks by the
+        // largest drift of the centers it is not assigned to
+        fastest = 0;
+        maxDrift = 0.0;
+        secondDrift = 0.0;
+        for (size_t j = 0; j < drift.size(); ++j) {
+            if (drift[j] > maxDrift) {
+                secondDrift = maxDrift;
+                maxDrift = drift[j];
+                fastest = j;
+            } else if (drift[j] > secondDrift) {
+                secondDrift = drift[j];
+            }
+        }
+    }
+
+    void assign(std::vector<int>& assignment, size_t begin, size_t end) override {
+        for (size_t i = begin; i < end; ++i) {
+            const Color& color = histogram.colors[i];
+            if (!firstPass) {
+                int a = assignment[i];
+                upper[i] += drift[a];
+                lower[i] -= static_cast<size_t>(a) == fastest ? secondDrift : maxDrift;
+
+                double bound = std::max(half[a], lower[i]);
+                if (upper[i] + boundSlack < bound) {
+                    continue;
+                }
+                upper[i] = centerDistance(color, centers[a]);
+                if (upper[i] + boundSlack < bound) {
+                    continue;
+                }
+            }
+
+            // Bounds could not rule the other centers out, rescan them all
+            int best = std::numeric_limits<int>::max();
+            int second = std::numeric_limits<int>::max();
+            size_t index = 0;
+            for (size_t j = 0; j < centers.size(); ++j) {
+                int dist = distanceSquared(color, centers[j]);
+                if (dist < best) {
+                    second = best;
+                    best = dist;
+                    index = j;
+                } else if (dist < second) {
+                    second = dist;
+                }
+            }
+            assignment[i] = index;
+            upper[i] = std::sqrt(static_cast<double>(best));
+            lower[i] = std::sqrt(static_cast<double>(second));
+        }
+    }
+
+private:
+    const ColorHistogram& histogram;
+    std::vector<double> upper;
+    std::vector<double> lower;
+    // Per iteration state shared by every range
+    std::vector<Color> centers;
+    std::vector<double> drift;
+    std::vector<double> half;
+    bool firstPass = true;
+    size_t fastest = 0;
+    double maxDrift = 0.0;
+    double secondDrift = 0.0;
+};
+
+// Elkan's algorithm, a lower bound per color and center plus the distances
+// between centers. Needs colors x K bounds but skips nearly every distance
+// once the centers settle, which pays off for large palettes.
+class ElkanAssigner : public CenterAssigner {
+public:
+    ElkanAssigner(const ColorHistogram& histogram, int K)
+        : histogram(histogram), K(K), upper(histogram.colors.size()),
+          lower(histogram.colors.size() * K) {}
+
+    void update(const std::vector<Color>& newCenters) override {
+        drift = centerDrift(centers, newCenters);
+        firstPass = centers.empty();
+        centers = newCenters;
+
+        between.resize(static_cast<size_t>(K) * K);
+        for (int j = 0; j < K; ++j) {
+            for (int k = 0; k < K; ++k) {
+                between[j * K + k] = centerDistance(centers[j], centers[k]);
+            }
+        }
+        half = halfNearestCenterDistance(centers);
+    }
+
+    void assign(std::vector<int>& assignment, size_t begin, size_t end) override {
+        for (size_t i = begin; i < end; ++i) {
+            const Color& color = histogram.colors[i];
+            double* bounds = &lower[i * K];
+
+            if (firstPass) {
+                size_t index = 0;
+                int best = std::numeric_limits<int>::max();
+                for (int j = 0; j < K; ++j) {
+                    int dist = distanceSquared(color, centers[j]);
+                    bounds[j] = std::sqrt(static_cast<double>(dist));
+                    if (dist < best) {
+                        best = dist;
+                        index = j;
+                    }
+                }
+                assignment[i] = index;
+                upper[i] = bounds[index];
+                continue;
+            }
+
+            int a = assignment[i];
+            upper[i] += drift[a];
+            for (int j = 0; j < K; ++j) {
+                bounds[j] = std::max(bounds[j] - drift[j], 0.0);
+            }
+            if (upper[i] + boundSlack < half[a]) {
+                continue;
+            }
+
+            bool upperIsExact = false;
+            int best = 0;
+            for (int j = 0; j < K; ++j) {
+                if (j == a) {
+                    continue;
+                }
+                if (upper[i] + boundSlack < bounds[j] ||
+                    upper[i] + boundSlack < 0.5 * between[a * K + j]) {
+                    continue;
+                }
+                if (!upperIsExact) {
+                    best = distanceSquared(color, centers[a]);
+                    upper[i] = std::sqrt(static_cast<double>(best));
+                    bounds[a] = upper[i];
+                    upperIsExact = true;
+                    if (upper[i] + boundSlack < bounds[j] ||
+                        upper[i] + boundSlack < 0.5 * between[a * K + j]) {
+                        continue;
+                    }
+                }
+
+                // Lower index wins a tie, like findClosestCenterIndex
+                int dist = distanceSquared(color, centers[j]);
+                bounds[j] = std::sqrt(static_cast<double>(dist));
+                if (dist < best || (dist == best && j < a)) {
+                    a = j;
+                    best = dist;
+                    upper[i] = bounds[j];
+                }
+            }
+            assignment[i] = a;
+        }
+    }
+
+private:
+    const ColorHistogram& histogram;
+    int K;
+    std::vector<double> upper;
+    std::vector<double> lower;
+    // Per iteration state shared by every range
+    std::vector<Color> centers;
+    std::vector<double> drift;
+    std::vector<double> between;
+    std::vector<double> half;
+    bool firstPass = true;
+};
+
+// Elkan keeps colors x K bounds, past this many it falls back to Hamerly.
+// 8 MiB of doubles per request, several run at once within one pod's memory.
+constexpr size_t maxElkanBounds = size_t(1) << 20;
+
+// The assignment makeCenterAssigner builds for method, AUTO picked from the
+// palette size and Elkan replaced when its bounds would not fit
+KmeansAssignment resolveAssignment(KmeansAssignment method, size_t colors, int K) {
+    size_t bounds = colors * static_cast<size_t>(K);
+    if (method == KMEANS_ASSIGN_AUTO) {
+        if (K <= 4) {
+            method = KMEANS_ASSIGN_BRUTE_FORCE;
+        } else if (K < 32) {
+            method = KMEANS_ASSIGN_HAMERLY;
+        } else {
+            method = KMEANS_ASSIGN_ELKAN;
+        }
+    }
+    if (method == KMEANS_ASSIGN_ELKAN && bounds > maxElkanBounds) {
+        method = KMEANS_ASSIGN_HAMERLY;
+    }
+    return method;
+}
+
+std::unique_ptr<CenterAssigner> makeCenterAssigner(KmeansAssignment method,
+                                                   const ColorHistogram& histogram,
+                                                   int K) {
+    switch (resolveAssignment(method, histogram.colors.size(), K)) {
+    case KMEANS_ASSIGN_HAMERLY:
+        return std::make_unique<HamerlyAssigner>(histogram);
+    case KMEANS_ASSIGN_ELKAN:
+        return std::make_unique<ElkanAssigner>(histogram, K);
+    default:
+        return std::make_unique<BruteForceAssigner>(histogram);
+    }
+}
+
+void ClusterSums::add(const Color& color, u_int32_t weight) {
+    for (int i = 0; i < 4; ++i) {
+        sum[i] += static_cast<unsigned long long>(color[i]) * weight;
+    }
+    count += weight;
+}
+
+// Update the center to be the mean of all colors assigned to it
+void updateCenter(Color& center, const ClusterSums& cluster) {
+    if (cluster.count == 0) return;
+
+    for (int i = 0; i < 4; ++i) {
+        center[i] = cluster.sum[i] / cluster.count;
+    }
+}
+
+// Every pixel of the same color lands in the same cluster, so the iterations
+// run over the distinct colors weighted by their pixel counts. That gives the
+// same centers as visiting every pixel for a fraction of the work.
+// Bands of colors are assigned and summed on the shared worker pool, each
+// into its own partial sums that are added up at the end of the iteration.
+// The sums are integers, so the centers do not depend on how many threads
+// ran or in which order the bands finished.
+// Starts from centers and stops as soon as an iteration leaves every center
+// where it was, from then on the assignments could never change again, after
+// maxIterations or when the time budget in options runs out, in which case
+// centers holds the current ones.
+QuantizeReport runKmeans(const ColorHistogram& histogram, std::vector<Color>& centers,
+                         int maxIterations, const QuantizeOptions& options) {
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::milliseconds(options.timeBudgetMs);
+    const int K = centers.size();
+    QuantizeReport report = {};
+    report.assignment = resolveAssignment(options.assignment, histogram.colors.size(), K);
+
+    std::unique_ptr<CenterAssigner> assigner =
+        makeCenterAssigner(report.assignment, histogram, K);
+    const size_t colorCount = histogram.colors.size();
+    std::vector<int> assignment(colorCount);
+    std::vector<ClusterSums> clusters(K);
+    std::vector<Color> previousCenters;
+
+    WorkerPool& pool = workerPool();
+    size_t bands = std::min((colorCount + kmeansBandColors - 1) / kmeansBandColors,
+                            static_cast<size_t>(pool.size()) * 4);
+    bands = std::max<size_t>(bands, 1);
+    std::vector<ClusterSums> partials(bands * K);
+
+    while (report.iterations < maxIterations) {
+        std::fill(partials.begin(), partials.end(), ClusterSums());
+
+        // Assign colors to the nearest center
+        assigner->update(centers);
+        pool.parallelFor(bands, [&](size_t band) {
+            size_t begin = colorCount * band / bands;
+            size_t end = colorCount * (band + 1) / bands;
+            assigner->assign(assignment, begin, end);
+            ClusterSums* sums = &partials[band * K];
+            for (size_t i = begin; i < end; ++i) {
+                sums[assignment[i]].add(histogram.colors[i], histogram.counts[i]);
+            }
+        });
+        std::fill(clusters.begin(), clusters.end(), ClusterSums());
+        for (size_t band = 0; band < bands; ++band) {
+            for (int i = 0; i < K; ++i) {
+                const ClusterSums& partial = partials[band * K + i];
+                for (int c = 0; c < 4; ++c) {
+                    clusters[i].sum[c] += partial.sum[c];
+                }
+                clusters[i].count += partial.count;
+            }
+        }
+
+        // Update centers
+        previousCenters = centers;
+        for (int i = 0; i < K; ++i) {
+            updateCenter(centers[i], clusters[i]);
+        }
+        ++report.iterations;
+
+        if (centers == previousCenters) {
+            report.converged = true;
+            break;
+        }
+        if (options.timeBudgetMs > 0 && std::chrono::steady_clock::now() >= deadline) {
+            break;
+        }
+    }
+
+    return report;
+}
+
+// Below this many colors the vector search wins over the table
+constexpr size_t paletteMapMinColors = 192;
+
+PaletteMap::PaletteMap(const std::vector<Color>& palette)
+    : palette(palette), table(palette),
+      useCells(palette.size() >= paletteMapMinColors),
+      maxCellScan(std::max<u_int32_t>(6, palette.size() / 64)) {
+    if (useCells) {
+        cells.resize(size_t(1) << (cellBits[0] + cellBits[1] + cellBits[2] + cellBits[3]));
+    }
+}
+
+size_t PaletteMap::cellOf(const u_int8_t* pixel) {
+    size_t cell = 0;
+    for (int c = 0; c < 4; ++c) {
+        cell = (cell << cellBits[c]) | (pixel[c] >> (8 - cellBits[c]));
+    }
+    return cell;
+}
+
+// A color can only be closest somewhere in the cell when its nearest point of
+// the cell is no farther than the farthest point is from the color that is
+// closest to the whole cell at worst
+void PaletteMap::fillCell(size_t cell, std::vector<int32_t>& out) const {
+    std::array<int, 4> low;
+    std::array<int, 4> high;
+    for (int c = 3; c >= 0; --c) {
+        int bin = cell & ((1 << cellBits[c]) - 1);
+        cell >>= cellBits[c];
+        low[c] = bin << (8 - cellBits[c]);
+        high[c] = low[c] + (1 << (8 - cellBits[c])) - 1;
+    }
+
+    std::vector<int> nearDistance(palette.size());
+    int bound = std::numeric_limits<int>::max();
+    for (size_t j = 0; j < palette.size(); ++j) {
+        int nearest = 0;
+        int farthest = 0;
+        for (int c = 0; c < 4; ++c) {
+            int v = palette[j][c];
+            int below = v < low[c] ? low[c] - v : v > high[c] ? v - high[c] : 0;
+            int above = std::max(std::abs(v - low[c]), std::abs(v - high[c]));
+            nearest += below * below;
+            farthest += above * above;
+        }
+        nearDistance[j] = nearest;
+        bound = std::min(bound, farthest);
+    }
+    for (size_t j = 0; j < palette.size(); ++j) {
+        if (nearDistance[j] <= bound) {
+            out.push_back(j);
+        }
+    }
+}
+
+void PaletteMap::prepare(const Mat& image) {
+    if (!useCells) {
+        return;
+    }
+    std::vector<std::atomic<bool>> wanted(cells.size());
+    parallelRows(image.height, [&](int y) {
+        const u_int8_t* row = image.row(y);
+        for (int x = 0; x < image.width; ++x) {
+            size_t cell = cellOf(row + x * image.channels);
+            if (cells[cell].count == 0 && !wanted[cell].load(std::memory_order_relaxed)) {
+                wanted[cell].store(true, std::memory_order_relaxed);
+            }
+        }
+    });
+    std::vector<size_t> missing;
+    for (size_t cell = 0; cell < cells.size(); ++cell) {
+        if (wanted[cell]) {
+            missing.push_back(cell);
+        }
+    }
+
+    // Filled in bands on the pool, then appended in cell order
+    const size_t bandCells = 256;
+    size_t bands = (missing.size() + bandCells - 1) / bandCells;
+    std::vector<std::vector<int32_t>> found(bands);
+    std::vector<std::vector<u_int32_t>> counts(bands);
+    workerPool().parallelFor(bands, [&](size_t band) {
+        size_t end = std::min((band + 1) * bandCells, missing.size());
+        for (size_t i = band * bandCells; i < end; ++i) {
+            size_t before = found[band].size();
+            fillCell(missing[i], found[band]);
+            counts[band].push_back(found[band].size() - before);
+        }
+    });
+    for (size_t band = 0; band < bands; ++band) {
+        candidates.reserve(candidates.size() + found[band].size());
+        auto next = found[band].begin();
+        for (size_t i = 0; i < counts[band].size(); ++i) {
+            Cell& cell = cells[missing[band * bandCells + i]];
+            cell.offset = candidates.size();
+            cell.count = counts[band][i];
+            candidates.insert(candidates.end(), next, next + cell.count);
+            next += cell.count;
+        }
+    }
+}
+
+int PaletteMap::scanCell(const Cell& cell, const u_int8_t* pixel) const {
+    const int32_t* list = &candidates[cell.offset];
+    int minDistance = std::numeric_limits<int>::max();
+    int index = 0;
+    for (u_int32_t i = 0; i < cell.count; ++i) {
+        const Color& color = palette[list[i]];
+        int dist = 0;
+        for (int c = 0; c < 4; ++c) {
+            dist += (pixel[c] - color[c]) * (pixel[c] - color[c]);
+        }
+        if (dist < minDistance) {
+            minDistance = dist;
+            index = list[i];
+        }
+    }
+    return index;
+}
+
+void PaletteMap::nearest(const u_int8_t* row, int width, int* indices) const {
+    if (!useCells) {
+        table.nearest(row, width, indices);
+        return;
+    }
+
+    // Pixels of crowded cells are gathered and searched together
+    thread_local std::vector<u_int32_t> crowded;
+    thread_local std::vector<int> crowdedX;
+    thread_local std::vector<int> crowdedIndices;
+    crowded.clear();
+    crowdedX.clear();
+    for (int x = 0; x < width; ++x) {
+        const u_int8_t* px = row + x * 4;
+        const Cell& cell = cells[cellOf(px)];
+        if (cell.count == 1) {
+            indices[x] = candidates[cell.offset];
+        } else if (cell.count <= maxCellScan) {
+            indices[x] = scanCell(cell, px);
+        } else {
+            u_int32_t packed;
+            std::memcpy(&packed, px, sizeof(packed));
+            crowded.push_back(packed);
+            crowdedX.push_back(x);
+        }
+    }
+    crowdedIndices.resize(crowded.size());
+    table.nearest(reinterpret_cast<const u_int8_t*>(crowded.data()), crowded.size(),
+                  crowdedIndices.data());
+    for (size_t i = 0; i < crowded.size(); ++i) {
+        indices[crowdedX[i]] = crowdedIndices[i];
+    }
+}
+
+// Runs body(y) for every row of an image, remapBandRows rows per worker
+void parallelRows(int height, const std::function<void(int y)>& body) {
+    size_t rowBands = (height + remapBandRows - 1) / remapBandRows;
+    workerPool().parallelFor(rowBands, [&](size_t band) {
+        int end = std::min(static_cast<int>(band + 1) * remapBandRows, height);
+        for (int y = band * remapBandRows; y < end; ++y) {
+            body(y);
+        }
+    });
+}
+
+// Replace every pixel of the image with its closest palette color
+void remapImage(Mat& image, const std::vector<Color>& centers) {
+    PaletteMap map(centers);
+    map.prepare(image);
+    parallelRows(image.height, [&](int y) {
+        thread_local std::vector<int> rowIndices;
+        rowIndices.resize(image.width);
+        u_int8_t* row = image.row(y);
+        map.nearest(row, image.width, rowIndices.data());
+        for (int x = 0; x < image.width; ++x) {
+            std::memcpy(row + x * image.channels, centers[rowIndices[x]].data(),
+                        image.channels);
+        }
+    });
+}
+
+// Index of the closest of at most 256 centers for every pixel. Centers no
+// pixel picked are dropped from the palette, which keeps the PNG bit depth
+// as low as it can go.
+IndexedImage indexImage(const Mat& image, const std::vector<Color>& centers) {
+    IndexedImage indexed;
+    indexed.indices = Mat(image.width, image.height, 1);
+    PaletteMap map(centers);
+    map.prepare(image);
+    std::vector<std::atomic<bool>> used(centers.size());
+    parallelRows(image.height, [&](int y) {
+        thread_local std::vector<int> rowIndices;
+        rowIndices.resize(image.width);
+        map.nearest(image.row(y), image.width, rowIndices.data());
+        u_int8_t* out = indexed.indices.row(y);
+        for (int x = 0; x < image.width; ++x) {
+            int index = rowIndices[x];
+            out[x] = index;
+            if (!used[index].load(std::memory_order_relaxed)) {
+                used[index].store(true, std::memory_order_relaxed);
+            }
+        }
+    });
+
+    std::array<u_int8_t, 256> renumber = {};
+    for (int translucent = 1; translucent >= 0; --translucent) {
+        for (size_t j = 0; j < centers.size(); ++j) {
+            if (used[j] && (centers[j][3] < 255) == static_cast<bool>(translucent)) {
+                renumber[j] = indexed.palette.size();
+                indexed.palette.push_back(centers[j]);
+            }
+        }
+    }
+    parallelRows(image.height, [&](int y) {
+        u_int8_t* row = indexed.indices.row(y);
+        for (int x = 0; x < image.width; ++x) {
+            row[x] = renumber[row[x]];
+        }
+    });
+    return indexed;
+}
+
+// Mean color of histogram entries [begin, end) of order
+Color weightedMean(const ColorHistogram& histogram, const std::vector<size_t>& order,
+                   size_t begin, size_t end) {
+    ClusterSums sums;
+    for (size_t i = begin; i < end; ++i) {
+        sums.add(histogram.colors[order[i]], histogram.counts[order[i]]);
+    }
+    Color color = {0, 0, 0, 0};
+    updateCenter(color, sums);
+    return color;
+}
+
+class KmeansSeedQuantizer : public Quantizer {
+public:
+    explicit KmeansSeedQuantizer(unsigned int seed) : seed(seed) {}
+
+    std::vector<Color> palette(const ColorHistogram& histogram, int K) override {
+        return seedCenters(histogram, K, seed);
+    }
+
+private:
+    unsigned int seed;
+};
+
+// Median cut, the box of colors with the most pixels times the widest channel
+// range is split at the pixel median of that channel until there are K boxes
+class MedianCutQuantizer : public Quantizer {
+public:
+    std::vector<Color> palette(const ColorHistogram& histogram, int K) override {
+        struct Box {
+            size_t begin;
+            size_t end;
+            unsigned long long pixels;
+            int channel; // widest channel
+            int range;
+        };
+        std::vector<size_t> order(histogram.colors.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        auto makeBox = [&](size_t begin, size_t end) {
+            Box box = {begin, end, 0, 0, 0};
+            Color low = {255, 255, 255, 255};
+            Color high = {0, 0, 0, 0};
+            for (size_t i = begin; i < end; ++i) {
+                const Color& color = histogram.colors[order[i]];
+                box.pixels += histogram.counts[order[i]];
+                for (int c = 0; c < 4; ++c) {
+                    low[c] = std::min(low[c], color[c]);
+                    high[c] = std::max(high[c], color[c]);
+                }
+            }
+            for (int c = 0; c < 4; ++c) {
+                if (high[c] - low[c] > box.range) {
+                    box.range = high[c] - low[c];
+                    box.channel = c;
+                }
+            }
+            return box;
+        };
+
+        std::vector<Box> boxes = {makeBox(0, order.size())};
+        while (static_cast<int>(boxes.size()) < K) {
+            // Boxes of a single color have no range and are never picked
+            size_t pick = boxes.size();
+            unsigned long long bestScore = 0;
+            for (size_t b = 0; b < boxes.size(); ++b) {
+                unsigned long long score = boxes[b].pixels * boxes[b].range;
+                if (score > bestScore) {
+                    bestScore = score;
+                    pick = b;
+                }
+            }
+            if (pick == boxes.size()) {
+                break;
+            }
+
+            Box box = boxes[pick];
+            int c = box.channel;
+            std::sort(order.begin() + box.begin, order.begin() + box.end,
+                      [&](size_t a, size_t b) {
+                          return histogram.colors[a][c] < histogram.colors[b][c];
+                      });
+            // First entry past half the pixels, kept off both ends so
+            // neither half is empty
+            size_t split = box.begin + 1;
+            unsigned long long seen = histogram.counts[order[box.begin]];
+            while (split + 1 < box.end && seen * 2 < box.pixels) {
+                seen += histogram.counts[order[split++]];
+            }
+            boxes[pick] = makeBox(box.begin, split);
+            boxes.push_back(makeBox(split, box.end));
+        }
+
+        std::vector<Color> centers;
+        for (const Box& box : boxes) {
+            centers.push_back(weightedMean(histogram, order, box.begin, box.end));
+        }
+        return centers;
+    }
+};
+
+// Octree over the top octreeBits bits of every channel. With alpha every node
+// has 16 children, one per combination of the next bit of R, G, B and A. The
+// deepest level with at most K nodes is kept whole, then the nodes of the level
+// below it with the fewest pixels are folded into their parents, as the
+// classic reduction does, until K leaves are left. When folding all children
+// of a node would leave fewer than K, only its smallest children are merged.
+constexpr int octreeBits = 5;
+
+class OctreeQuantizer : public Quantizer {
+public:
+    std::vector<Color> palette(const ColorHistogram& histogram, int K) override {
+        // Interleaved bits, most significant first, so the colors under a node
+        // are the ones sharing a prefix of the key
+        auto key = [](const Color& color) {
+            u_int32_t k = 0;
+            for (int bit = 7; bit >= 8 - octreeBits; --bit) {
+                for (int c = 0; c < 4; ++c) {
+                    k = (k << 1) | ((color[c] >> bit) & 1);
+                }
+            }
+            return k;
+        };
+        std::vector<size_t> order(histogram.colors.size());
+        std::vector<u_int32_t> keys(histogram.colors.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+            keys[i] = key(histogram.colors[i]);
+        }
+        std::sort(order.begin(), order.end(),
+                  [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+        auto prefix = [&](size_t i, int level) {
+            return keys[order[i]] >> (4 * (octreeBits - level));
+        };
+        auto nodesAt = [&](int level) {
+            size_t nodes = 0;
+            for (size_t i = 0; i < order.size(); ++i) {
+                nodes += i == 0 || prefix(i, level) != prefix(i - 1, level);
+            }
+            return nodes;
+        };
+
+        int level = 0;
+        while (level < octreeBits && nodesAt(level + 1) <= static_cast<size_t>(K)) {
+            ++level;
+        }
+
+        // Runs of order under one node of `level`, each with the start of
+        // every child of the level below
+        struct Node {
+            size_t begin;
+            size_t end;
+            unsigned long long pixels;
+            std::vector<size_t> children;
+        };
+        std::vector<Node> nodes;
+        size_t leaves = 0;
+        for (size_t i = 0; i < order.size(); ++i) {
+            if (i == 0 || prefix(i, level) != prefix(i - 1, level)) {
+                nodes.push_back({i, i, 0, {}});
+            }
+            Node& node = nodes.back();
+            if (level < octreeBits &&
+                (node.children.empty() || prefix(i, level + 1) != prefix(i - 1, level + 1))) {
+                node.children.push_back(i);
+                ++leaves;
+            }
+            node.end = i + 1;
+            node.pixels += histogram.counts[order[i]];
+        }
+        if (level == octreeBits) {
+            leaves = nodes.size();
+        }
+
+        std::vector<size_t> byPixels(nodes.size());
+        for (size_t n = 0; n < nodes.size(); ++n) {
+            byPixels[n] = n;
+        }
+        std::stable_sort(byPixels.begin(), byPixels.end(), [&](size_t a, size_t b) {
+            return nodes[a].pixels < nodes[b].pixels;
+        });
+        // Folded nodes are a single leaf. At most one node is folded in part,
+        // its children flagged in partial share one leaf.
+        std::vector<bool> folded(nodes.size(), level == octreeBits);
+        size_t partialNode = nodes.size();
+        std::vector<bool> partial;
+        auto childEnd = [&](const Node& node, size_t c) {
+            return c + 1 < node.children.size() ? node.children[c + 1] : node.end;
+        };
+        auto childPixels = [&](const Node& node, size_t c) {
+            unsigned long long pixels = 0;
+            for (size_t i = node.children[c]; i < childEnd(node, c); ++i) {
+                pixels += histogram.counts[order[i]];
+            }
+            return pixels;
+        };
+        for (size_t n : byPixels) {
+            if (leaves <= static_cast<size_t>(K)) {
+                break;
+            }
+            const Node& node = nodes[n];
+            size_t excess = leaves - K;
+            if (node.children.size() <= excess + 1) {
+                leaves -= node.children.size() - 1;
+                folded[n] = true;
+                continue;
+            }
+            std::vector<unsigned long long> sizes;
+            std::vector<size_t> smallest;
+            for (size_t c = 0; c < node.children.size(); ++c) {
+                sizes.push_back(childPixels(node, c));
+                smallest.push_back(c);
+            }
+            std::stable_sort(smallest.begin(), smallest.end(),
+                             [&](size_t a, size_t b) { return sizes[a] < sizes[b]; });
+            partialNode = n;
+            partial.assign(node.children.size(), false);
+            for (size_t c = 0; c <= excess; ++c) {
+                partial[smallest[c]] = true;
+            }
+            leaves = K;
+        }
+
+        std::vector<Color> centers;
+        for (size_t n = 0; n < nodes.size(); ++n) {
+            const Node& node = nodes[n];
+            if (folded[n]) {
+                centers.push_back(weightedMean(histogram, order, node.begin, node.end));
+                continue;
+            }
+            ClusterSums rest;
+            for (size_t c = 0; c < node.children.size(); ++c) {
+                if (n != partialNode || !partial[c]) {
+                    centers.push_back(weightedMean(histogram, order, node.children[c],
+                                                   childEnd(node, c)));
+                    continue;
+                }
+                for (size_t i = node.children[c]; i < childEnd(node, c); ++i) {
+                    rest.add(histogram.colors[order[i]], histogram.counts[order[i]]);
+                }
+            }
+            if (rest.count > 0) {
+                Color color = {0, 0, 0, 0};
+                updateCenter(color, rest);
+                centers.push_back(color);
+            }
+        }
+        return centers;
+    }
+};
+
+// Wu's quantizer. Colors are binned on a coarse R,G,B,A grid holding the
+// cumulative pixel count, channel sums and sum of squares, so the totals of
+// any box of cells come from its 16 corners. The box with the largest
+// variance is cut where the two halves leave the least variance, until there
+// are K boxes. Alpha gets fewer bins, most images have only a few levels.
+constexpr std::array<int, 4> wuBits = {5, 5, 5, 3};
+
+class WuQuantizer : public Quantizer {
+public:
+    std::vector<Color> palette(const ColorHistogram& histogram, int K) override {
+        for (int c = 0; c < 4; ++c) {
+            size[c] = (1 << wuBits[c]) + 1;
+        }
+        size_t cells = static_cast<size_t>(size[0]) * size[1] * size[2] * size[3];
+        weight.assign(cells, 0);
+        for (auto& moment : sums) {
+            moment.assign(cells, 0);
+        }
+        squares.assign(cells, 0.0);
+
+        // Bin 0 of every channel stays empty so the prefix sums need no edge cases
+        for (size_t i = 0; i < histogram.colors.size(); ++i) {
+            const Color& color = histogram.colors[i];
+            std::array<int, 4> at;
+            for (int c = 0; c < 4; ++c) {
+                at[c] = (color[c] >> (8 - wuBits[c])) + 1;
+            }
+            size_t cell = index(at);
+            unsigned long long count = histogram.counts[i];
+            weight[cell] += count;
+            double square = 0;
+            for (int c = 0; c < 4; ++c) {
+                sums[c][cell] += count * color[c];
+                square += static_cast<double>(color[c]) * color[c];
+            }
+            squares[cell] += square * count;
+        }
+        for (int axis = 0; axis < 4; ++axis) {
+            accumulate(axis);
+        }
+
+        std::vector<Box> boxes(1);
+        for (int c = 0; c < 4; ++c) {
+            boxes[0].low[c] = 0;
+            boxes[0].high[c] = size[c] - 1;
+        }
+        std::vector<double> variances = {variance(boxes[0])};
+        while (static_cast<int>(boxes.size()) < K) {
+            size_t pick = 0;
+            for (size_t b = 1; b < boxes.size(); ++b) {
+                if (variances[b] > variances[pick]) {
+                    pick = b;
+                }
+            }
+            Box upper;
+            if (variances[pick] <= 0 || !cut(boxes[pick], upper)) {
+                // Nothing left to cut in the worst box, try it no more
+                if (variances[pick] <= 0) {
+                    break;
+                }
+                variances[pick] = 0;
+                continue;
+            }
+            variances[pick] = variance(boxes[pick]);
+            boxes.push_back(upper);
+            variances.push_back(variance(upper));
+        }
+
+        std::vector<Color> centers;
+        for (const Box& box : boxes) {
+            Moments m = total(box);
+            if (m.weight == 0) {
+                continue;
+            }
+            Color color;
+            for (int c = 0; c < 4; ++c) {
+                color[c] = m.sums[c] / m.weight;
+            }
+            centers.push_back(color);
+        }
+        return centers;
+    }
+
+private:
+    // Cells (low, high] along every channel
+    struct Box {
+        std::array<int, 4> low;
+        std::array<int, 4> high;
+    };
+    struct Moments {
+        long long weight = 0;
+        std::array<long long, 4> sums = {0, 0, 0, 0};
+        double squares = 0;
+    };
+
+    size_t index(const std::array<int, 4>& at) const {
+        return ((static_cast<size_t>(at[0]) * size[1] + at[1]) * size[2] + at[2]) * size[3] + at[3];
+    }
+
+    void accumulate(int axis) {
+        size_t step = 1;
+        for (int c = axis + 1; c < 4; ++c) {
+            step *= size[c];
+        }
+        size_t span = step * size[axis];
+        for (size_t base = 0; base < weight.size(); base += span) {
+            for (size_t i = base + step; i < base + span; ++i) {
+                weight[i] += weight[i - step];
+                for (auto& moment : sums) {
+                    moment[i] += moment[i - step];
+                }
+                squares[i] += squares[i - step];
+            }
+        }
+    }
+
+    // Totals of the box with channel `axis` running up to `at` instead of
+    // box.high, inclusion-exclusion over the corners of the cumulative grid
+    Moments total(const Box& box, int axis = -1, int at = 0) const {
+        Moments m;
+        for (int corner = 0; corner < 16; ++corner) {
+            std::array<int, 4> point;
+            int sign = 1;
+            for (int c = 0; c < 4; ++c) {
+                int high = c == axis ? at : box.high[c];
+                if (corner & (1 << c)) {
+                    point[c] = box.low[c];
+                    sign = -sign;
+                } else {
+                    point[c] = high;
+                }
+            }
+            size_t cell = index(point);
+            m.weight += sign * static_cast<long long>(weight[cell]);
+            for (int c = 0; c < 4; ++c) {
+                m.sums[c] += sign * static_cast<long long>(sums[c][cell]);
+            }
+            m.squares += sign * squares[cell];
+        }
+        return m;
+    }
+
+    static double spread(const Moments& m) {
+        double sum = 0;
+        for (int c = 0; c < 4; ++c) {
+            sum += static_cast<double>(m.sums[c]) * m.sums[c];
+        }
+        return sum / m.weight;
+    }
+
+    double variance(const Box& box) const {
+        Moments m = total(box);
+        return m.weight > 0 ? m.squares - spread(m) : 0.0;
+    }
+
+    // Splits box at the cut that maximizes the spread of the two halves,
+    // box keeps the lower half and upper gets the other. False when no cut
+    // leaves pixels on both sides.
+    bool cut(Box& box, Box& upper) const {
+        Moments whole = total(box);
+        double best = -1;
+        int bestAxis = -1;
+        int bestAt = 0;
+        for (int axis = 0; axis < 4; ++axis) {
+            for (int at = box.low[axis] + 1; at < box.high[axis]; ++at) {
+                Moments lower = total(box, axis, at);
+                Moments rest;
+                rest.weight = whole.weight - lower.weight;
+                for (int c = 0; c < 4; ++c) {
+                    rest.sums[c] = whole.sums[c] - lower.sums[c];
+                }
+                if (lower.weight == 0 || rest.weight == 0) {
+                    continue;
+                }
+                double score = spread(lower) + spread(rest);
+                if (score > best) {
+                    best = score;
+                    bestAxis = axis;
+                    bestAt = at;
+                }
+            }
+        }
+        if (bestAxis < 0) {
+            return false;
+        }
+        upper = box;
+        upper.low[bestAxis] = bestAt;
+        box.high[bestAxis] = bestAt;
+        return true;
+    }
+
+    std::array<int, 4> size;
+    std::vector<unsigned long long> weight;
+    std::array<std::vector<unsigned long long>, 4> sums;
+    std::vector<double> squares;
+};
+
+std::unique_ptr<Quantizer> makeQuantizer(const QuantizeOptions& options) {
+    switch (options.method) {
+    case QUANTIZE_MEDIAN_CUT:
+        return std::make_unique<MedianCutQuantizer>();
+    case QUANTIZE_OCTREE:
+        return std::make_unique<OctreeQuantizer>();
+    case QUANTIZE_WU:
+        return std::make_unique<WuQuantizer>();
+    default:
+        return std::make_unique<KmeansSeedQuantizer>(options.seed);
+    }
+}
+
+// Palette of at most K colors for the image. The quantizer in options picks
+// the starting palette from the color histogram, then k-means refines it, for
+// as long as maxIterations allows after k-means++ seeding and
+// refineIterations after the single pass methods.
+QuantizeReport quantizeMat(const Mat& image, int K, const QuantizeOptions& options,
+                           std::vector<Color>& palette) {
+    ColorHistogram histogram = buildColorHistogram(image);
+    palette = makeQuantizer(options)->palette(histogram, K);
+
+    int iterations = options.refineIterations;
+    if (options.method == QUANTIZE_KMEANS) {
+        iterations = options.maxIterations > 0 ? options.maxIterations : 50;
+    }
+    QuantizeReport report = runKmeans(histogram, palette, iterations, options);
+
+    // Centers repeat when the image has fewer than K colors, keep the first
+    std::vector<Color> distinct;
+    std::unordered_set<u_int32_t> seen;
+    for (const Color& color : palette) {
+        u_int32_t packed;
+        std::memcpy(&packed, color.data(), sizeof(packed));
+        if (seen.insert(packed).second) {
+            distinct.push_back(color);
+        }
+    }
+    palette = std::move(distinct);
+    return report;
+}
+
+// 8-bit pixels with the channels of the source, gray, gray and alpha, RGB or
+// RGBA, palettes becoming RGB or RGBA depending on their transparency. alpha
+// adds an opaque alpha channel to sources without one, rgb expands gray.
+void setDecodeTransforms(png_structp png, png_infop info, bool alpha, bool rgb) {
+  png_byte color_type = png_get_color_type(png, info);
+  png_byte bit_depth = png_get_bit_depth(png, info);
+
+  // Convert PNG to a format we can work with
+  if (bit_depth == 16)
+    png_set_strip_16(png);
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE)
+    png_set_palette_to_rgb(png);
+
+  // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
+  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+    png_set_expand_gray_1_2_4_to_8(png);
+
+  if (png_get_valid(png, info, PNG_INFO_tRNS))
+    png_set_tRNS_to_alpha(png);
+
+  // These color_type don't have an alpha channel then fill it with 0xff.
+  if (alpha && (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY ||
+                color_type == PNG_COLOR_TYPE_PALETTE))
+    png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+
+  if (rgb && (color_type == PNG_COLOR_TYPE_GRAY ||
+              color_type == PNG_COLOR_TYPE_GRAY_ALPHA))
+    png_set_gray_to_rgb(png);
+
+  // Let png_read_image combine the Adam7 passes of interlaced files
+  png_set_interlace_handling(png);
+
+  png_read_update_info(png, info);
+}
+
+MappedFile::~MappedFile() {
+  if (mapped) {
+    munmap(const_cast<u_int8_t *>(bytes), length);
+  }
+}
+
+bool MappedFile::open(const char *path) {
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+    void *address = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address != MAP_FAILED) {
+      // Decoders read front to back, let the kernel read ahead further
+      madvise(address, info.st_size, MADV_SEQUENTIAL);
+      bytes = static_cast<const u_int8_t *>(address);
+      length = info.st_size;
+      mapped = true;
+      close(fd);
+      return true;
+    }
+  }
+
+  u_int8_t chunk[1 << 16];
+  ssize_t count;
+  while ((count = read(fd, chunk, sizeof(chunk))) > 0) {
+    buffer.insert(buffer.end(), chunk, chunk + count);
+  }
+  close(fd);
+  bytes = buffer.data();
+  length = buffer.size();
+  return count == 0;
+}
+
+ReplacingFile::~ReplacingFile() {
+  if (fp) {
+    fclose(fp);
+    unlink(temporaryPath.c_str());
+  }
+}
+
+bool ReplacingFile::open(const char *destination) {
+  // Unique within the process, O_EXCL skips names a crashed run left behind
+  static std::atomic<unsigned> serial{0};
+  path = destination;
+  for (int attempt = 0; attempt < 16; ++attempt) {
+    temporaryPath = path + ".tmp" + std::to_string(getpid()) + "-" +
+                    std::to_string(serial++);
+    int fd = ::open(temporaryPath.c_str(),
+                    O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0) {
+      if (errno == EEXIST) {
+        continue;
+      }
+      return false;
+    }
+    fp = fdopen(fd, "wb");
+    if (!fp) {
+      close(fd);
+      unlink(temporaryPath.c_str());
+      return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+bool ReplacingFile::commit() {
+  // The last buffered bytes reach the file here, a failure loses the image
+  bool written = fclose(fp) == 0;
+  fp = nullptr;
+  if (!written || rename(temporaryPath.c_str(), path.c_str()) != 0) {
+    unlink(temporaryPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+// libpng read callback over a PngReadCursor, fails like a short file read
+void readFromMemory(png_structp png, png_bytep out, png_size_t length) {
+  PngReadCursor *cursor = static_cast<PngReadCursor *>(png_get_io_ptr(png));
+  if (length > cursor->size - cursor->offset) {
+    png_error(png, "Read Error");
+  }
+  std::memcpy(out, cursor->data + cursor->offset, length);
+  cursor->offset += length;
+}
+
+std::variant<Mat, Error> readPng(const char *imagePath, bool rgba) {
+  MappedFile file;
+  if (!file.open(imagePath)) {
+    return Error("File could not be opened for reading");
+  }
+  return decodePng(file.data(), file.size(), rgba);
+}
+
+// Whole image with the channels setDecodeTransforms gives it
+std::variant<Mat, Error> decodePng(const u_int8_t *bytes, size_t size, bool rgba) {
+#ifdef USE_LIBDEFLATE
+  Mat decoded = decodePngDeflate(bytes, size, rgba);
+  if (!decoded.empty()) {
+    return decoded;
+  }
+#endif
+  PngReadCursor cursor = {bytes, size};
+  // The image and its row pointers are filled in after the setjmp below,
+  // they live behind rows so a longjmp back skips no destructor of theirs
+  struct DecodedRows {
+    Mat image;
+    std::vector<png_bytep> pointers;
+  };
+  const auto rows = std::make_unique<DecodedRows>();
+
+  png_structp png =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png) {
+    return Error("Failed to create PNG read structure");
+  }
+
+  png_infop info = png_create_info_struct(png);
+  if (!info) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    return Error("Failed to create PNG info structure");
+  }
+
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    return Error("Error during PNG creation");
+  }
+
+  png_set_read_fn(png, &cursor, readFromMemory);
+  png_read_info(png, info);
+
+  int width = png_get_image_width(png, info);
+  int height = png_get_image_height(png, info);
+  setDecodeTransforms(png, info, rgba, rgba);
+
+  // The transformations above leave packed 8-bit pixels, decode them
+  // straight into the image rows
+  rows->image = Mat(width, height, png_get_channels(png, info));
+  rows->pointers.resize(height);
+  for (int y = 0; y < height; y++) {
+    rows->pointers[y] = rows->image.row(y);
+  }
+
+  png_read_image(png, rows->pointers.data());
+
+  png_destroy_read_struct(&png, &info, NULL);
+
+  return std::move(rows->image);
+}
+// Box filter geometry of a resize, keeps the aspect ratio by centering an
+// effectiveWidth x effectiveHeight block in the new image and leaving the
+// rest as transparent padding
+BoxLayout computeBoxLayout(int originalWidth, int originalHeight, int newWidth,
+                           int newHeight) {
+    BoxLayout layout;
+    layout.originalWidth = originalWidth;
+    layout.originalHeight = originalHeight;
+
+    // Calculate aspect ratios
+    float originalAspect = static_cast<float>(originalWidth) / originalHeight;
+    float newAspect = static_cast<float>(newWidth) / newHeight;
+
+    // Calculate effective width and height after considering aspect ratio
+    if (originalAspect > newAspect) {
+        // Width is the limiting dimension
+        layout.effectiveWidth = newWidth;
+        layout.effectiveHeight = static_cast<int>(newWidth / originalAspect);
+    } else {
+        // Height is the limiting dimension
+        layout.effectiveWidth = static_cast<int>(newHeight * originalAspect);
+        layout.effectiveHeight = newHeight;
+    }
+
+    layout.offsetX = (newWidth - layout.effectiveWidth) / 2;
+    layout.offsetY = (newHeight - layout.effectiveHeight) / 2;
+    layout.xRatio = static_cast<float>(originalWidth) / layout.effectiveWidth;
+    layout.yRatio = static_cast<float>(originalHeight) / layout.effectiveHeight;
+    return layout;
+}
+
+BoxColumnSums::BoxColumnSums(const BoxLayout &layout, int channels)
+    : layout(layout), channels(channels),
+      sums(static_cast<size_t>(layout.originalWidth) * channels),
+      prefix(static_cast<size_t>(layout.originalWidth + 1) * channels) {}
+
+void BoxColumnSums::clear() {
+    std::fill(sums.begin(), sums.end(), 0);
+    rows = 0;
+}
+
+void BoxColumnSums::addRow(const u_int8_t *row) {
+    size_t n = sums.size();
+    for (size_t i = 0; i < n; ++i) {
+        sums[i] += row[i];
+    }
+    ++rows;
+}
+
+// Writes the effectiveWidth box means of the accumulated rows to out.
+// Each mean is one difference of the prefix sums over the columns,
+// truncated the same way the per-block mean always was
+void BoxColumnSums::emitRow(u_int8_t *out) {
+    switch (channels) {
+    case 1:
+        emitPixels<1>(out);
+        break;
+    case 2:
+        emitPixels<2>(out);
+        break;
+    case 3:
+        emitPixels<3>(out);
+        break;
+    default:
+        emitPixels<4>(out);
+        break;
+    }
+}
+
+// emitRow for a fixed channel count, the channel loops unroll
+template <int Channels> void BoxColumnSums::emitPixels(u_int8_t *out) {
+    for (int c = 0; c < Channels; ++c) {
+        prefix[c] = 0;
+    }
+    for (int x = 0; x < layout.originalWidth; ++x) {
+        for (int c = 0; c < Channels; ++c) {
+            prefix[(x + 1) * Channels + c] =
+                prefix[x * Channels + c] + sums[x * Channels + c];
+        }
+    }
+
+    for (int j = 0; j < layout.effectiveWidth; ++j) {
+        int startX = layout.startX(j);
+        int endX = layout.endX(j);
+        unsigned long long count =
+            static_cast<unsigned long long>(std::max(endX - startX, 0)) * rows;
+        u_int8_t *px = out + j * Channels;
+        for (int c = 0; c < Channels; ++c) {
+            // An empty block falls back to a transparent pixel
+            px[c] = count > 0 ? static_cast<u_int8_t>(
+                                    (prefix[endX * Channels + c] -
+                                     prefix[startX * Channels + c]) /
+                                    count)
+                              : 0;
+        }
+    }
+}
+
+// Source pixels a band of a parallel resize sums at least, smaller ones cost
+// more to hand to another thread than they save
+constexpr size_t resizeBandMinPixels = size_t(1) << 18;
+constexpr size_t resizeBandsPerThread = 4;
+
+// Resize the image to newWidth x newHeight
+// using the mean of the pixels in the area
+// of the original image that maps to each pixel
+// also, keeps the aspect ratio by adding 0 alpha padding
+Mat resize(const Mat& image, int newWidth, int newHeight) {
+    return resample(image, newWidth, newHeight, SCALE_FILTER_BOX);
+}
+
+// Box means of image into the effective area of layout, placed at its offset
+// in a newWidth x newHeight image
+Mat resizeWithLayout(const Mat& image, const BoxLayout& layout, int newWidth,
+                     int newHeight) {
+    // Initialize new image with padding if necessary
+    Mat newImage(newWidth, newHeight, image.channels); // Default to transparent for padding
+
+    // Output rows only depend on the source, bands of them run on the worker
+    // pool. Padding rows are already transparent and left out of the bands,
+    // every row in one costs about the same.
+    int rows = layout.effectiveHeight;
+    size_t bands = resizeBands(layout);
+    workerPool().parallelFor(bands, [&](size_t band) {
+        // Source rows are summed once per output row into column totals, so every
+        // output pixel costs a constant amount of work however large its block is
+        BoxColumnSums columns(layout, image.channels);
+        int end = static_cast<int>((band + 1) * rows / bands);
+        for (int i = static_cast<int>(band * rows / bands); i < end; i++) {
+            columns.clear();
+            for (int y = layout.startY(i); y < layout.endY(i); ++y) {
+                columns.addRow(image.row(y));
+            }
+            columns.emitRow(newImage.pixel(layout.offsetX, i + layout.offsetY));
+        }
+    });
+
+    return newImage;
+}
+
+// Bands of output rows for resizeWithLayout, resizeBandsPerThread per pool
+// thread so a late thread holds up little, as long as each still sums
+// resizeBandMinPixels. Short outputs of tall sources get as many bands as
+// the work allows, not as their row count would.
+size_t resizeBands(const BoxLayout& layout) {
+    if (layout.effectiveHeight <= 0) {
+        return 1;
+    }
+    size_t rows = layout.effectiveHeight;
+    size_t rowPixels =
+        static_cast<size_t>(layout.yRatio + 1) * layout.originalWidth;
+    size_t bands = std::min(
+        rows, static_cast<size_t>(workerPool().size()) * resizeBandsPerThread);
+    return std::max<size_t>(
+        std::min(bands, rows * rowPixels / resizeBandMinPixels), 1);
+}
+
+// Separable resampling. Rows are first resampled along x into an image as
+// wide as the output and as tall as the source rows it needs, then that
+// along y into the output. Both passes weigh 8-bit pixels with 16-bit fixed
+// point weights and sum in 32 bits, so the scalar and vector kernels give
+// the same bytes. Like the box filter the channels are not premultiplied.
+constexpr int resampleWeightBits = 14;
+// Tables of this many size pairs are kept for the next resample
+constexpr size_t resampleTableCacheSize = 64;
+
+// Half width of the filter in source pixels when not shrinking
+double resampleFilterSupport(ScaleFilter filter) {
+    switch (filter) {
+    case SCALE_FILTER_BILINEAR:
+        return 1.0;
+    case SCALE_FILTER_BICUBIC:
+        return 2.0;
+    case SCALE_FILTER_LANCZOS3:
+        return 3.0;
+    default:
+        return 0.5;
+    }
+}
+
+double sinc(double x) {
+    if (x == 0.0) {
+        return 1.0;
+    }
+    x *= M_PI;
+    return std::sin(x) / x;
+}
+
+double resampleFilterWeight(ScaleFilter filter, double x) {
+    x = std::fabs(x);
+    switch (filter) {
+    case SCALE_FILTER_BILINEAR:
+        return x < 1.0 ? 1.0 - x : 0.0;
+    case SCALE_FILTER_BICUBIC: {
+        // Keys cubic with a = -0.5
+        const double a = -0.5;
+        if (x < 1.0) {
+            return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+        }
+        if (x < 2.0) {
+            return ((a * x - 5.0 * a) * x + 8.0 * a) * x - 4.0 * a;
+        }
+        return 0.0;
+    }
+    case SCALE_FILTER_LANCZOS3:
+        return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+    default:
+        return x < 0.5 ? 1.0 : 0.0;
+    }
+}
+
+// Weights of every output pixel along an axis of inSize source pixels. The
+// filter is centered on the output pixel and stretched over the source when
+// shrinking, area instead weighs each source pixel by how much of the output
+// pixel it covers. The fixed point weights of an output add up to exactly
+// one, a flat color stays the same.
+ResampleTable buildResampleTable(ScaleFilter filter, int inSize, int outSize) {
+    double scale = static_cast<double>(inSize) / outSize;
+    double filterScale = std::max(scale, 1.0);
+    double support = filter == SCALE_FILTER_AREA
+                         ? std::max(scale, 1.0) / 2 + 1
+                         : resampleFilterSupport(filter) * filterScale;
+
+    std::vector<int> first(outSize);
+    std::vector<std::vector<double>> contributions(outSize);
+    int taps = 1;
+    for (int i = 0; i < outSize; ++i) {
+        double center = (i + 0.5) * scale;
+        int start = std::max(static_cast<int>(center - support + 0.5), 0);
+        int end = std::min(static_cast<int>(center + support + 0.5), inSize);
+        std::vector<double> &weights = contributions[i];
+        double total = 0;
+        for (int x = start; x < end; ++x) {
+            double weight;
+            if (filter == SCALE_FILTER_AREA) {
+                weight = std::max(std::min(x + 1.0, (i + 1) * scale) -
+                                      std::max(static_cast<double>(x), i * scale),
+                                  0.0);
+            } else {
+                weight = resampleFilterWeight(filter, (x - center + 0.5) / filterScale);
+            }
+            if (std::fabs(weight) < 1e-9) {
+                // Lanczos zero crossings come out a rounding error off zero
+                weight = 0.0;
+            }
+            weights.push_back(weight);
+            total += weight;
+        }
+        // Trim taps that came out zero at both ends
+        while (!weights.empty() && weights.back() == 0.0) {
+            weights.pop_back();
+        }
+        size_t leading = 0;
+        while (leading < weights.size() && weights[leading] == 0.0) {
+            ++leading;
+        }
+        weights.erase(weights.begin(), weights.begin() + leading);
+        start += leading;
+        if (weights.empty() || total == 0.0) {
+            // Nothing under the filter, take the nearest source pixel
+            weights.assign(1, 1.0);
+            start = std::min(static_cast<int>(center), inSize - 1);
+            total = 1.0;
+        }
+        for (double &weight : weights) {
+            weight /= total;
+        }
+        first[i] = start;
+        taps = std::max(taps, static_cast<int>(weights.size()));
+    }
+
+    ResampleTable table;
+    table.taps = std::min(taps, inSize);
+    table.bounds.resize(outSize);
+    table.weights.assign(static_cast<size_t>(outSize) * table.taps, 0);
+    const int one = 1 << resampleWeightBits;
+    for (int i = 0; i < outSize; ++i) {
+        const std::vector<double> &weights = contributions[i];
+        // Windows near the right edge slide left to stay inside the source
+        int bound = std::min(first[i], inSize - table.taps);
+        int16_t *fixed = &table.weights[static_cast<size_t>(i) * table.taps];
+        int sum = 0;
+        int largest = first[i] - bound;
+        for (size_t k = 0; k < weights.size(); ++k) {
+            int tap = first[i] - bound + static_cast<int>(k);
+            fixed[tap] = static_cast<int16_t>(std::lround(weights[k] * one));
+            sum += fixed[tap];
+            if (fixed[tap] > fixed[largest]) {
+                largest = tap;
+            }
+        }
+        fixed[largest] += one - sum;
+        table.bounds[i] = bound;
+    }
+    return table;
+}
+
+std::mutex resampleTableMutex;
+std::map<std::tuple<int, int, int>, std::shared_ptr<const ResampleTable>>
+    resampleTables;
+std::deque<std::tuple<int, int, int>> resampleTableOrder; // oldest first
+
+// buildResampleTable, remembered for the last resampleTableCacheSize size
+// pairs, a ladder or a stream of same-sized uploads builds each table once
+std::shared_ptr<const ResampleTable> resampleTable(ScaleFilter filter, int inSize,
+                                                   int outSize) {
+    auto key = std::make_tuple(static_cast<int>(filter), inSize, outSize);
+    {
+        std::lock_guard<std::mutex> lock(resampleTableMutex);
+        auto found = resampleTables.find(key);
+        if (found != resampleTables.end()) {
+            return found->second;
+        }
+    }
+
+    auto table = std::make_shared<const ResampleTable>(
+        buildResampleTable(filter, inSize, outSize));
+    std::lock_guard<std::mutex> lock(resampleTableMutex);
+    if (resampleTables.emplace(key, table).second) {
+        resampleTableOrder.push_back(key);
+        if (resampleTableOrder.size() > resampleTableCacheSize) {
+            resampleTables.erase(resampleTableOrder.front());
+            resampleTableOrder.pop_front();
+        }
+    }
+    return table;
+}
+
+u_int8_t clampResampled(int32_t sum) {
+    sum = (sum + (1 << (resampleWeightBits - 1))) >> resampleWeightBits;
+    return static_cast<u_int8_t>(std::min(std::max(sum, 0), 255));
+}
+
+// One row of Channels channel pixels along x, out holds
+// table.bounds.size() pixels
+template <int Channels>
+void resampleRowScalar(const u_int8_t* source, u_int8_t* out,
+                       const ResampleTable& table) {
+    size_t count = table.bounds.size();
+    for (size_t i = 0; i < count; ++i) {
+        const u_int8_t* px = source + table.bounds[i] * Channels;
+        const int16_t* weights = &table.weights[i * table.taps];
+        int32_t sum[Channels] = {};
+        for (int k = 0; k < table.taps; ++k) {
+            for (int c = 0; c < Channels; ++c) {
+                sum[c] += px[k * Channels + c] * weights[k];
+            }
+        }
+        for (int c = 0; c < Channels; ++c) {
+            out[i * Channels + c] = clampResampled(sum[c]);
+        }
+    }
+}
+
+// Byte shuffle putting the same channel of two neighbouring pixels next to
+// each other as 16-bit words, pixels 0 and 1 in the low lane, 2 and 3 in the
+// high lane, ready for a multiply-add with a pair of weights
+alignas(32) const u_int32_t resamplePairShuffle[8] = {
+    0x80048000, 0x80058001, 0x80068002, 0x80078003,
+    0x800C8008, 0x800D8009, 0x800E800A, 0x800F800B};
+
+// RGBA rows only
+__attribute__((target("avx2")))
+void resampleRowAvx2(const u_int8_t* source, u_int8_t* out,
+                     const ResampleTable& table) {
+    const __m256i toPairs =
+        _mm256_load_si256(reinterpret_cast<const __m256i*>(resamplePairShuffle));
+    const __m128i rounding = _mm_set1_epi32(1 << (resampleWeightBits - 1));
+    size_t count = table.bounds.size();
+    for (size_t i = 0; i < count; ++i) {
+        const u_int8_t* px = source + table.bounds[i] * 4;
+        const int16_t* weights = &table.weights[i * table.taps];
+        __m256i sum = _mm256_setzero_si256();
+        int k = 0;
+        for (; k + 4 <= table.taps; k += 4) {
+            __m128i four = _mm_loadu_si128(reinterpret_cast<const __m128i*>(px + k * 4));
+            __m256i pairs = _mm256_shuffle_epi8(
+                _mm256_inserti128_si256(_mm256_castsi128_si256(four), four, 1), toPairs);
+            int32_t low, high;
+            std::memcpy(&low, weights + k, sizeof(low));
+            std::memcpy(&high, weights + k + 2, sizeof(high));
+            sum = _mm256_add_epi32(
+                sum, _mm256_madd_epi16(pairs, _mm256_setr_epi32(low, low, low, low,
+                                                                 high, high, high, high)));
+        }
+        __m128i total = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                                      _mm256_extracti128_si256(sum, 1));
+        for (; k < table.taps; ++k) {
+            int32_t pixel;
+            std::memcpy(&pixel, px + k * 4, sizeof(pixel));
+            total = _mm_add_epi32(
+                total, _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(pixel)),
+                                       _mm_set1_epi32(weights[k])));
+        }
+        total = _mm_srai_epi32(_mm_add_epi32(total, rounding), resampleWeightBits);
+        __m128i packed = _mm_packs_epi32(total, total);
+        int32_t result = _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+        std::memcpy(out + i * 4, &result, sizeof(result));
+    }
+}
+
+// One output row of bytes from taps source rows along y
+void resampleColumnScalar(const u_int8_t* const* rows, const int16_t* weights,
+                          int taps, size_t bytes, u_int8_t* out) {
+    for (size_t x = 0; x < bytes; ++x) {
+        int32_t sum = 0;
+        for (int k = 0; k < taps; ++k) {
+            sum += rows[k][x] * weights[k];
+        }
+        out[x] = clampResampled(sum);
+    }
+}
+
+// 32 bytes at a time, two source rows per multiply-add
+__attribute__((target("avx2")))
+void resampleColumnAvx2(const u_int8_t* const* rows, const int16_t* weights,
+                        int taps, size_t bytes, u_int8_t* out) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i rounding = _mm256_set1_epi32(1 << (resampleWeightBits - 1));
+    size_t x = 0;
+    for (; x + 32 <= bytes; x += 32) {
+        __m256i sums[4] = {zero, zero, zero, zero};
+        for (int k = 0; k < taps; k += 2) {
+            // An odd last row pairs with itself at weight 0
+            int next = k + 1 < taps ? k + 1 : k;
+            int32_t pair = static_cast<u_int16_t>(weights[k]) |
+                           (k + 1 < taps ? static_cast<int32_t>(weights[k + 1]) << 16 : 0);
+            __m256i weight = _mm256_set1_epi32(pair);
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[k] + x));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[next] + x));
+            __m256i aLow = _mm256_unpacklo_epi8(a, zero);
+            __m256i aHigh = _mm256_unpackhi_epi8(a, zero);
+            __m256i bLow = _mm256_unpacklo_epi8(b, zero);
+            __m256i bHigh = _mm256_unpackhi_epi8(b, zero);
+            sums[0] = _mm256_add_epi32(
+                sums[0], _mm256_madd_epi16(_mm256_unpacklo_epi16(aLow, bLow), weight));
+            sums[1] = _mm256_add_epi32(
+                sums[1], _mm256_madd_epi16(_mm256_unpackhi_epi16(aLow, bLow), weight));
+            sums[2] = _mm256_add_epi32(
+                sums[2], _mm256_madd_epi16(_mm256_unpacklo_epi16(aHigh, bHigh), weight));
+            sums[3] = _mm256_add_epi32(
+                sums[3], _mm256_madd_epi16(_mm256_unpackhi_epi16(aHigh, bHigh), weight));
+        }
+        for (auto& sum : sums) {
+            sum = _mm256_srai_epi32(_mm256_add_epi32(sum, rounding), resampleWeightBits);
+        }
+        // The unpacks and packs both work per 128-bit lane, undoing each other
+        __m256i low = _mm256_packs_epi32(sums[0], sums[1]);
+        __m256i high = _mm256_packs_epi32(sums[2], sums[3]);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x),
+                            _mm256_packus_epi16(low, high));
+    }
+    if (x < bytes) {
+        std::vector<const u_int8_t*> rest(rows, rows + taps);
+        for (auto& row : rest) {
+            row += x;
+        }
+        resampleColumnScalar(rest.data(), weights, taps, bytes - x, out + x);
+    }
+}
+
+ResampleRowKernel selectResampleRowKernel(int channels) {
+    switch (channels) {
+    case 1:
+        return resampleRowScalar<1>;
+    case 2:
+        return resampleRowScalar<2>;
+    case 3:
+        return resampleRowScalar<3>;
+    }
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return resampleRowAvx2;
+    }
+    return resampleRowScalar<4>;
+}
+
+ResampleColumnKernel selectResampleColumnKernel() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return resampleColumnAvx2;
+    }
+    return resampleColumnScalar;
+}
+
+// resizeWithLayout with any filter, the separable ones resample the whole
+// source into the effective area of layout
+Mat resampleWithLayout(const Mat& image, const BoxLayout& layout, int newWidth,
+                       int newHeight, ScaleFilter filter) {
+    bool padded = layout.effectiveWidth != newWidth || layout.effectiveHeight != newHeight;
+    if (padded && (image.channels == 1 || image.channels == 3)) {
+        // The padding is transparent, an image without alpha gains one
+        BoxLayout unpadded = layout;
+        unpadded.offsetX = 0;
+        unpadded.offsetY = 0;
+        return padImage(resampleWithLayout(image, unpadded, layout.effectiveWidth,
+                                           layout.effectiveHeight, filter),
+                        layout, newWidth, newHeight);
+    }
+    if (filter == SCALE_FILTER_BOX || layout.effectiveWidth <= 0 ||
+        layout.effectiveHeight <= 0) {
+        return resizeWithLayout(image, layout, newWidth, newHeight);
+    }
+    static const std::array<ResampleRowKernel, 5> rowKernels = {
+        NULL, selectResampleRowKernel(1), selectResampleRowKernel(2),
+        selectResampleRowKernel(3), selectResampleRowKernel(4)};
+    static const ResampleColumnKernel columnKernel = selectResampleColumnKernel();
+    const ResampleRowKernel rowKernel = rowKernels[image.channels];
+
+    auto columns = resampleTable(filter, image.width, layout.effectiveWidth);
+    auto rows = resampleTable(filter, image.height, layout.effectiveHeight);
+
+    // Only the source rows some output row reads go through the first pass
+    int firstRow = rows->bounds.front();
+    int lastRow = rows->bounds.back() + rows->taps;
+    Mat horizontal(layout.effectiveWidth, lastRow - firstRow, image.channels);
+    parallelRows(horizontal.height, [&](int y) {
+        rowKernel(image.row(firstRow + y), horizontal.row(y), *columns);
+    });
+
+    Mat newImage(newWidth, newHeight, image.channels);
+    size_t rowBytes = static_cast<size_t>(layout.effectiveWidth) * image.channels;
+    parallelRows(layout.effectiveHeight, [&](int i) {
+        thread_local std::vector<const u_int8_t*> sources;
+        sources.resize(rows->taps);
+        for (int k = 0; k < rows->taps; ++k) {
+            sources[k] = horizontal.row(rows->bounds[i] - firstRow + k);
+        }
+        columnKernel(sources.data(), &rows->weights[static_cast<size_t>(i) * rows->taps],
+                     rows->taps, rowBytes,
+                     newImage.pixel(layout.offsetX, i + layout.offsetY));
+    });
+    return newImage;
+}
+
+// resize with any filter
+Mat resample(const Mat& image, int newWidth, int newHeight, ScaleFilter filter) {
+    return resampleWithLayout(
+        image, computeBoxLayout(image.width, image.height, newWidth, newHeight),
+        newWidth, newHeight, filter);
+}
+
+// image, the effective area of layout, placed at its offset in a transparent
+// newWidth x newHeight image. Images without alpha get an opaque alpha
+// channel when there is padding to see through.
+Mat padImage(const Mat& image, const BoxLayout& layout, int newWidth, int newHeight) {
+    if (image.width == newWidth && image.height == newHeight) {
+        return image;
+    }
+    bool addAlpha = image.channels == 1 || image.channels == 3;
+    Mat padded(newWidth, newHeight, image.channels + (addAlpha ? 1 : 0));
+    for (int y = 0; y < image.height; ++y) {
+        const u_int8_t* in = image.row(y);
+        u_int8_t* out = padded.pixel(layout.offsetX, y + layout.offsetY);
+        if (!addAlpha) {
+            std::memcpy(out, in, static_cast<size_t>(image.width) * image.channels);
+            continue;
+        }
+        for (int x = 0; x < image.width; ++x) {
+            std::memcpy(out, in, image.channels);
+            out[image.channels] = 255;
+            in += image.channels;
+            out += padded.channels;
+        }
+    }
+    return padded;
+}
+
+// Gray, gray alpha or RGB pixels as RGBA, opaque unless the source has alpha
+Mat expandToRgba(const Mat& image) {
+    Mat rgba(image.width, image.height, 4);
+    bool gray = image.channels < 3;
+    bool alpha = image.channels % 2 == 0;
+    for (int y = 0; y < image.height; ++y) {
+        const u_int8_t* in = image.row(y);
+        u_int8_t* out = rgba.row(y);
+        for (int x = 0; x < image.width; ++x) {
+            out[0] = in[0];
+            out[1] = in[gray ? 0 : 1];
+            out[2] = in[gray ? 0 : 2];
+            out[3] = alpha ? in[image.channels - 1] : 255;
+            in += image.channels;
+            out += 4;
+        }
+    }
+    return rgba;
+}
+
+// Compression level, row filters and deflate strategy of a profile. Palette
+// images get no row filters whatever the profile.
+DeflateSettings encodeSettings(PngEncodeProfile profile, bool palette) {
+  switch (profile) {
+  case PNG_ENCODE_FAST:
+    return {1, Z_RLE, palette ? PNG_FILTER_NONE : PNG_FILTER_SUB};
+  case PNG_ENCODE_SMALLEST:
+    return {9, palette ? Z_DEFAULT_STRATEGY : Z_FILTERED,
+            palette ? PNG_FILTER_NONE : PNG_ALL_FILTERS};
+  default:
+    // What libpng picks when left alone
+    return {Z_DEFAULT_COMPRESSION, palette ? Z_DEFAULT_STRATEGY : Z_FILTERED,
+            palette ? PNG_FILTER_NONE : PNG_ALL_FILTERS};
+  }
+}
+
+void setEncodeProfile(png_structp png, PngEncodeProfile profile, bool palette) {
+  DeflateSettings settings = encodeSettings(profile, palette);
+  png_set_compression_level(png, settings.level);
+  png_set_compression_strategy(png, settings.strategy);
+  png_set_filter(png, PNG_FILTER_TYPE_BASE, settings.filters);
+}
+
+// PNG color type of 8-bit pixels with this many channels
+int pngColorType(int channels) {
+  switch (channels) {
+  case 1:
+    return PNG_COLOR_TYPE_GRAY;
+  case 2:
+    return PNG_COLOR_TYPE_GRAY_ALPHA;
+  case 3:
+    return PNG_COLOR_TYPE_RGB;
+  default:
+    return PNG_COLOR_TYPE_RGBA;
+  }
+}
+
+// 8-bit PNG of image in the color type matching its channels
+std::variant<Success, Error> writePng(FILE *fp, const Mat &image,
+                                      PngEncoding &encoding) {
+  PngLayout layout;
+  layout.width = image.width;
+  layout.height = image.height;
+  layout.colorType = pngColorType(image.channels);
+  layout.rowBytes = static_cast<size_t>(image.width) * image.channels;
+  layout.pixelBytes = image.channels;
+
+  if (useChunkedDeflate(layout.rowBytes * layout.height)) {
+    ChunkedPngWriter writer(layout, encoding.profile);
+    if (writer.begin(fp)) {
+      for (int y = 0; y < image.height; ++y) {
+        writer.writeRow(image.row(y));
+      }
+    }
+    return writer.finish(encoding);
+  }
+#ifdef USE_LIBDEFLATE
+  return writePngDeflate(
+      fp, layout, [&](int y, u_int8_t *) { return image.row(y); }, encoding);
+#else
+  auto start = std::chrono::steady_clock::now();
+  png_structp png_ptr =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png_ptr) {
+    return Error("Failed to create PNG write structure.");
+  }
+
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    png_destroy_write_struct(&png_ptr, NULL);
+    return Error("Failed to create PNG info structure.");
+  }
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return Error("Error during PNG creation.");
+  }
+
+  png_init_io(png_ptr, fp);
+
+  int bit_depth = 8;
+  int color_type = layout.colorType;
+  int width = image.width;
+  int height = image.height;
+
+  png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  setEncodeProfile(png_ptr, encoding.profile, false);
+
+  png_write_info(png_ptr, info_ptr);
+
+  // Image rows are already packed pixels, hand them to libpng as they are
+  for (int y = 0; y < height; y++) {
+    png_write_row(png_ptr, const_cast<png_bytep>(image.row(y)));
+  }
+
+  png_write_end(png_ptr, NULL);
+
+  // Cleanup
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+
+  encoding.elapsed += std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  return Success(true);
+#endif
+}
+
+// Smallest PNG bit depth that holds every index of a palette
+int paletteBitDepth(size_t colors) {
+  return colors <= 2 ? 1 : colors <= 4 ? 2 : colors <= 16 ? 4 : 8;
+}
+
+// Palette PNG at the smallest bit depth that holds every index, with a tRNS
+// chunk for the translucent entries at the front of the palette
+std::variant<Success, Error> writeIndexedPng(FILE *fp,
+                                             const IndexedImage &image,
+                                             PngEncoding &encoding) {
+  size_t colors = image.palette.size();
+  std::vector<png_color> palette(colors);
+  std::vector<png_byte> alpha;
+  for (size_t i = 0; i < colors; ++i) {
+    palette[i] = {image.palette[i][0], image.palette[i][1], image.palette[i][2]};
+    if (image.palette[i][3] < 255) {
+      alpha.push_back(image.palette[i][3]);
+    }
+  }
+
+  PngLayout layout;
+  layout.width = image.indices.width;
+  layout.height = image.indices.height;
+  layout.bitDepth = paletteBitDepth(colors);
+  layout.colorType = PNG_COLOR_TYPE_PALETTE;
+  layout.rowBytes = (static_cast<size_t>(layout.width) * layout.bitDepth + 7) / 8;
+  layout.pixelBytes = 1;
+  layout.palette = palette;
+  layout.alpha = alpha;
+
+  // Indices packed most significant bits first, as PNG stores them
+  auto packedRow = [&](int y, u_int8_t *packed) -> const u_int8_t * {
+    const u_int8_t *indices = image.indices.row(y);
+    if (layout.bitDepth == 8) {
+      return indices;
+    }
+    std::fill(packed, packed + layout.rowBytes, 0);
+    int perByte = 8 / layout.bitDepth;
+    for (int x = 0; x < layout.width; ++x) {
+      packed[x / perByte] |= indices[x] << (8 - layout.bitDepth * (x % perByte + 1));
+    }
+    return packed;
+  };
+
+  if (useChunkedDeflate(layout.rowBytes * layout.height)) {
+    ChunkedPngWriter writer(layout, encoding.profile);
+    if (writer.begin(fp)) {
+      std::vector<u_int8_t> packed(layout.rowBytes);
+      for (int y = 0; y < layout.height; ++y) {
+        writer.writeRow(packedRow(y, packed.data()));
+      }
+    }
+    return writer.finish(encoding);
+  }
+#ifdef USE_LIBDEFLATE
+  return writePngDeflate(fp, layout, packedRow, encoding);
+#else
+  auto start = std::chrono::steady_clock::now();
+  png_structp png_ptr =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png_ptr) {
+    return Error("Failed to create PNG write structure.");
+  }
+
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    png_destroy_write_struct(&png_ptr, NULL);
+    return Error("Failed to create PNG info structure.");
+  }
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return Error("Error during PNG creation.");
+  }
+
+  png_init_io(png_ptr, fp);
+
+  png_set_IHDR(png_ptr, info_ptr, image.indices.width, image.indices.height,
+               paletteBitDepth(colors), PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  setEncodeProfile(png_ptr, encoding.profile, true);
+
+  png_set_PLTE(png_ptr, info_ptr, palette.data(), colors);
+  if (!alpha.empty()) {
+    png_set_tRNS(png_ptr, info_ptr, alpha.data(), alpha.size(), NULL);
+  }
+
+  png_write_info(png_ptr, info_ptr);
+
+  // Index rows hold one index per byte, libpng packs them to bit_depth
+  png_set_packing(png_ptr);
+  for (int y = 0; y < image.indices.height; y++) {
+    png_write_row(png_ptr, const_cast<png_bytep>(image.indices.row(y)));
+  }
+
+  png_write_end(png_ptr, NULL);
+
+  // Cleanup
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+
+  encoding.elapsed += std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  return Success(true);
+#endif
+}
+
+// Images past this many bytes of rows are encoded by ChunkedPngWriter when
+// the worker pool has more than one thread
+constexpr size_t chunkedDeflateMinBytes = size_t(4) << 20;
+// Filtered bytes deflated by one worker
+constexpr size_t chunkedDeflateBandBytes = size_t(1) << 20;
+
+constexpr u_int8_t pngSignature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+bool useChunkedDeflate(size_t imageBytes) {
+  return imageBytes >= chunkedDeflateMinBytes && workerPool().size() > 1;
+}
+
+u_int8_t paeth(int left, int up, int upLeft) {
+  int p = left + up - upLeft;
+  int pa = std::abs(p - left);
+  int pb = std::abs(p - up);
+  int pc = std::abs(p - upLeft);
+  if (pa <= pb && pa <= pc) {
+    return left;
+  }
+  return pb <= pc ? up : upLeft;
+}
+
+// Filter byte and filtered row into out, rowBytes + 1 bytes. With several
+// filters allowed the one with the smallest sum of absolute byte values
+// wins, the same heuristic libpng uses. previous is NULL for the first row.
+void filterRow(const u_int8_t *row, const u_int8_t *previous, size_t rowBytes,
+               int pixelBytes, int filters, u_int8_t *out) {
+  static const std::array<int, 5> flags = {PNG_FILTER_NONE, PNG_FILTER_SUB,
+                                           PNG_FILTER_UP, PNG_FILTER_AVG,
+                                           PNG_FILTER_PAETH};
+  thread_local std::vector<u_int8_t> candidate;
+  candidate.resize(rowBytes + 1);
+  unsigned long long bestSum = std::numeric_limits<unsigned long long>::max();
+  for (int type = 0; type < 5; ++type) {
+    if (!(filters & flags[type])) {
+      continue;
+    }
+    u_int8_t *filtered = candidate.data() + 1;
+    unsigned long long sum = 0;
+    for (size_t i = 0; i < rowBytes; ++i) {
+      int left = i >= static_cast<size_t>(pixelBytes) ? row[i - pixelBytes] : 0;
+      int up = previous ? previous[i] : 0;
+      int upLeft = previous && i >= static_cast<size_t>(pixelBytes)
+                       ? previous[i - pixelBytes]
+                       : 0;
+      int predicted = type == 1   ? left
+                      : type == 2 ? up
+                      : type == 3 ? (left + up) / 2
+                      : type == 4 ? paeth(left, up, upLeft)
+                                  : 0;
+      filtered[i] = static_cast<u_int8_t>(row[i] - predicted);
+      sum += filtered[i] < 128 ? filtered[i] : 256 - filtered[i];
+    }
+    if (sum < bestSum) {
+      bestSum = sum;
+      candidate[0] = type;
+      std::memcpy(out, candidate.data(), rowBytes + 1);
+    }
+  }
+}
+
+// One PNG chunk, length, type, data and the CRC of type and data
+bool writeChunk(FILE *fp, const char *type,
+                std::initializer_list<std::pair<const void *, size_t>> parts) {
+  size_t length = 0;
+  for (const auto &part : parts) {
+    length += part.second;
+  }
+  u_int8_t header[8];
+  png_save_uint_32(header, static_cast<png_uint_32>(length));
+  std::memcpy(header + 4, type, 4);
+  uLong crc = crc32(0, header + 4, 4);
+  bool ok = fwrite(header, 1, 8, fp) == 8;
+  for (const auto &part : parts) {
+    if (part.second == 0) {
+      continue;
+    }
+    crc = crc32(crc, static_cast<const Bytef *>(part.first), part.second);
+    ok = ok && fwrite(part.first, 1, part.second, fp) == part.second;
+  }
+  u_int8_t trailer[4];
+  png_save_uint_32(trailer, static_cast<png_uint_32>(crc));
+  return ok && fwrite(trailer, 1, 4, fp) == 4;
+}
+
+// Signature, IHDR and the palette chunks, everything before the first IDAT
+bool writePngHeader(FILE *fp, const PngLayout &layout) {
+  u_int8_t ihdr[13];
+  png_save_uint_32(ihdr, layout.width);
+  png_save_uint_32(ihdr + 4, layout.height);
+  ihdr[8] = layout.bitDepth;
+  ihdr[9] = layout.colorType;
+  ihdr[10] = PNG_COMPRESSION_TYPE_BASE;
+  ihdr[11] = PNG_FILTER_TYPE_BASE;
+  ihdr[12] = PNG_INTERLACE_NONE;
+
+  bool ok = fwrite(pngSignature, 1, 8, fp) == 8 &&
+            writeChunk(fp, "IHDR", {{ihdr, sizeof(ihdr)}});
+  if (ok && !layout.palette.empty()) {
+    ok = writeChunk(fp, "PLTE",
+                    {{layout.palette.data(), layout.palette.size() * sizeof(png_color)}});
+  }
+  if (ok && !layout.alpha.empty()) {
+    ok = writeChunk(fp, "tRNS", {{layout.alpha.data(), layout.alpha.size()}});
+  }
+  return ok;
+}
+
+ChunkedPngWriter::ChunkedPngWriter(const PngLayout &layout, PngEncodeProfile profile)
+    : layout(layout),
+      settings(encodeSettings(profile, layout.colorType == PNG_COLOR_TYPE_PALETTE)),
+      bandRows(std::max<int>(1, chunkedDeflateBandBytes / (layout.rowBytes + 1))),
+      batchRows(bandRows * workerPool().size()), adler(adler32(0, NULL, 0)) {
+  rows.reserve(static_cast<size_t>(batchRows) * layout.rowBytes);
+}
+
+void ChunkedPngWriter::fail(const Error &message) {
+  if (error.empty()) {
+    error = message;
+  }
+}
+
+bool ChunkedPngWriter::begin(FILE *out) {
+  fp = out;
+  if (!writePngHeader(fp, layout)) {
+    fail("Failed to write PNG.");
+    return false;
+  }
+  return true;
+}
+
+void ChunkedPngWriter::writeRow(const u_int8_t *row) {
+  rows.insert(rows.end(), row, row + layout.rowBytes);
+  if (rows.size() == static_cast<size_t>(batchRows) * layout.rowBytes) {
+    auto start = std::chrono::steady_clock::now();
+    flush(false);
+    elapsed += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+  }
+}
+
+// Filters and deflates the buffered rows a band per worker and appends them
+// as IDAT chunks. The band closing the image gets Z_FINISH, even when it has
+// no rows left, which leaves an empty final block.
+void ChunkedPngWriter::flush(bool last) {
+  if (!fp || !error.empty()) {
+    rows.clear();
+    return;
+  }
+  const size_t filteredBytes = layout.rowBytes + 1;
+  const int count = rows.size() / layout.rowBytes;
+  const size_t bands = std::max<size_t>((count + bandRows - 1) / bandRows, last ? 1 : 0);
+
+  struct Band {
+    std::vector<u_int8_t> filtered;
+    std::vector<u_int8_t> deflated;
+    uLong adler = 0;
+    bool failed = false;
+  };
+  std::vector<Band> output(bands);
+
+  workerPool().parallelFor(bands, [&](size_t b) {
+    int first = b * bandRows;
+    int end = std::min(first + bandRows, count);
+    Band &band = output[b];
+    band.filtered.resize((end - first) * filteredBytes);
+    for (int y = first; y < end; ++y) {
+      const u_int8_t *row = rows.data() + y * layout.rowBytes;
+      const u_int8_t *up = y > 0 ? row - layout.rowBytes
+                                 : previousRow.empty() ? NULL : previousRow.data();
+      filterRow(row, up, layout.rowBytes, layout.pixelBytes, settings.filters,
+                band.filtered.data() + (y - first) * filteredBytes);
+    }
+    band.adler = adler32(adler32(0, NULL, 0), band.filtered.data(),
+                         band.filtered.size());
+  });
+
+  workerPool().parallelFor(bands, [&](size_t b) {
+    Band &band = output[b];
+    z_stream stream = {};
+    if (deflateInit2(&stream, settings.level, Z_DEFLATED, -15, 8,
+                     settings.strategy) != Z_OK) {
+      band.failed = true;
+      return;
+    }
+    // The 32 KiB before the band, from the band before it or the last batch
+    const std::vector<u_int8_t> &before = b > 0 ? output[b - 1].filtered : window;
+    if (!before.empty()) {
+      size_t size = std::min<size_t>(before.size(), 32768);
+      deflateSetDictionary(&stream, before.data() + before.size() - size, size);
+    }
+    // Room for the sync flush marker on top of the worst case
+    band.deflated.resize(deflateBound(&stream, band.filtered.size()) + 16);
+    stream.next_in = band.filtered.data();
+    stream.avail_in = band.filtered.size();
+    stream.next_out = band.deflated.data();
+    stream.avail_out = band.deflated.size();
+    int flushMode = last && b + 1 == bands ? Z_FINISH : Z_SYNC_FLUSH;
+    int status = deflate(&stream, flushMode);
+    band.failed = flushMode == Z_FINISH ? status != Z_STREAM_END
+                                        : status != Z_OK || stream.avail_in != 0;
+    band.deflated.resize(stream.total_out);
+    deflateEnd(&stream);
+  });
+
+  // zlib header for a 32 KiB window, with the level hint zlib would give
+  int level = settings.level == Z_DEFAULT_COMPRESSION ? 6 : settings.level;
+  int levelHint = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+  u_int8_t zlibHeader[2] = {0x78, static_cast<u_int8_t>(levelHint << 6)};
+  zlibHeader[1] += 31 - (zlibHeader[0] * 256 + zlibHeader[1]) % 31;
+
+  for (size_t b = 0; b < bands; ++b) {
+    const Band &band = output[b];
+    if (band.failed) {
+      fail("Failed to deflate PNG rows.");
+      break;
+    }
+    adler = adler32_combine(adler, band.adler, band.filtered.size());
+    u_int8_t zlibTrailer[4];
+    png_save_uint_32(zlibTrailer, static_cast<png_uint_32>(adler));
+    bool closing = last && b + 1 == bands;
+    if (!writeChunk(fp, "IDAT",
+                    {{zlibHeader, startedStream ? 0 : sizeof(zlibHeader)},
+                     {band.deflated.data(), band.deflated.size()},
+                     {zlibTrailer, closing ? sizeof(zlibTrailer) : 0}})) {
+      fail("Failed to write PNG.");
+      break;
+    }
+    startedStream = true;
+  }
+
+  for (size_t b = bands; b-- > 0;) {
+    if (!output[b].filtered.empty()) {
+      window = std::move(output[b].filtered);
+      break;
+    }
+  }
+  if (count > 0) {
+    previousRow.assign(rows.end() - layout.rowBytes, rows.end());
+  }
+  rows.clear();
+}
+
+std::variant<Success, Error> ChunkedPngWriter::finish(PngEncoding &encoding) {
+  auto start = std::chrono::steady_clock::now();
+  flush(true);
+  if (error.empty() && !writeChunk(fp, "IEND", {})) {
+    fail("Failed to write PNG.");
+  }
+  if (!error.empty()) {
+    return error;
+  }
+  elapsed += std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  encoding.elapsed += elapsed;
+  return Success(true);
+}
+
+#ifdef USE_LIBDEFLATE
+// Whole-buffer PNG codec on libdeflate, built with DEFLATE=libdeflate. It
+// inflates and deflates every IDAT byte in one call, which is several times
+// faster than zlib's streaming interface but cannot resume, so the row by
+// row encoder of the streaming resize and ChunkedPngWriter stay on zlib.
+
+// Reverses the PNG filter of one row in place, previous is the row above
+// already unfiltered, NULL for the first row
+bool unfilterRow(u_int8_t *row, const u_int8_t *previous, size_t rowBytes,
+                 int pixelBytes, int filter) {
+  size_t bpp = pixelBytes;
+  switch (filter) {
+  case PNG_FILTER_VALUE_NONE:
+    return true;
+  case PNG_FILTER_VALUE_SUB:
+    for (size_t i = bpp; i < rowBytes; ++i) {
+      row[i] += row[i - bpp];
+    }
+    return true;
+  case PNG_FILTER_VALUE_UP:
+    if (previous) {
+      for (size_t i = 0; i < rowBytes; ++i) {
+        row[i] += previous[i];
+      }
+    }
+    return true;
+  case PNG_FILTER_VALUE_AVG:
+    for (size_t i = 0; i < rowBytes; ++i) {
+      int left = i >= bpp ? row[i - bpp] : 0;
+      int up = previous ? previous[i] : 0;
+      row[i] += (left + up) >> 1;
+    }
+    return true;
+  case PNG_FILTER_VALUE_PAETH:
+    for (size_t i = 0; i < rowBytes; ++i) {
+      int left = i >= bpp ? row[i - bpp] : 0;
+      int up = previous ? previous[i] : 0;
+      int upLeft = previous && i >= bpp ? previous[i - bpp] : 0;
+      row[i] += paeth(left, up, upLeft);
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Decodes non-interlaced 8-bit gray, gray and alpha, RGB and RGBA files and
+// palette files of any depth to the same pixels and channels
+// setDecodeTransforms gets out of libpng for rgba. Returns an empty Mat for
+// every other format and for damaged files, decodePng then decodes them with
+// libpng, which explains what is wrong.
+Mat decodePngDeflate(const u_int8_t *bytes, size_t size, bool rgba) {
+  if (size < 8 || std::memcmp(bytes, pngSignature, 8) != 0) {
+    return Mat();
+  }
+
+  png_uint_32 width = 0;
+  png_uint_32 height = 0;
+  int bitDepth = 0;
+  int colorType = -1;
+  bool hasPalette = false;
+  bool hasTransparency = false;
+  std::array<Color, 256> palette;
+  palette.fill({0, 0, 0, 255});
+  std::vector<u_int8_t> idat;
+
+  for (size_t pos = 8; pos + 12 <= size;) {
+    png_uint_32 length = png_get_uint_32(bytes + pos);
+    if (length > size - pos - 12) {
+      return Mat();
+    }
+    const u_int8_t *type = bytes + pos + 4;
+    const u_int8_t *data = type + 4;
+    if (libdeflate_crc32(0, type, length + 4) != png_get_uint_32(data + length)) {
+      return Mat();
+    }
+    pos += length + 12;
 
-// Find the index of the closest center to a given color
-size_t findClosestCenterIndex(const std::vector<Color>& centers, const Color& color) {
-    int minDistance = std::numeric_limits<int>::max();
-    size_t index = 0;
-    for (size_t i = 0; i < centers.size(); ++i) {
-        int dist = distanceSquared(color, centers[i]);
-        if (dist < minDistance) {
-            minDistance = dist;
-            index = i;
+    if (std::memcmp(type, "IHDR", 4) == 0) {
+      // Deflate compression, adaptive filters and no interlacing only
+      if (length != 13 || data[10] != 0 || data[11] != 0 || data[12] != 0) {
+        return Mat();
+      }
+      width = png_get_uint_32(data);
+      height = png_get_uint_32(data + 4);
+      bitDepth = data[8];
+      colorType = data[9];
+    } else if (colorType < 0) {
+      return Mat();
+    } else if (std::memcmp(type, "PLTE", 4) == 0) {
+      if (length % 3 != 0 || length > 256 * 3) {
+        return Mat();
+      }
+      for (size_t i = 0; i < length / 3; ++i) {
+        palette[i] = {data[i * 3], data[i * 3 + 1], data[i * 3 + 2], 255};
+      }
+      hasPalette = true;
+    } else if (std::memcmp(type, "tRNS", 4) == 0) {
+      hasTransparency = true;
+      if (colorType == PNG_COLOR_TYPE_PALETTE) {
+        for (size_t i = 0; i < std::min<size_t>(length, 256); ++i) {
+          palette[i][3] = data[i];
         }
+      }
+    } else if (std::memcmp(type, "IDAT", 4) == 0) {
+      idat.insert(idat.end(), data, data + length);
+    } else if (std::memcmp(type, "IEND", 4) == 0) {
+      break;
+    } else if (!(type[0] & 0x20)) {
+      // Unknown critical chunk
+      return Mat();
     }
-    return index;
-}
+  }
 
-// Update the center to be the mean of all colors assigned to it
-void updateCenter(Color& center, const std::vector<Color>& assignedColors) {
-    if (assignedColors.empty()) return;
+  int channels = 0;
+  switch (colorType) {
+  case PNG_COLOR_TYPE_GRAY:
+    channels = hasTransparency ? 0 : 1;
+    break;
+  case PNG_COLOR_TYPE_GRAY_ALPHA:
+    channels = 2;
+    break;
+  case PNG_COLOR_TYPE_RGB:
+    channels = hasTransparency ? 0 : 3;
+    break;
+  case PNG_COLOR_TYPE_RGB_ALPHA:
+    channels = 4;
+    break;
+  case PNG_COLOR_TYPE_PALETTE:
+    channels = hasPalette ? 1 : 0;
+    break;
+  }
+  bool palettized = colorType == PNG_COLOR_TYPE_PALETTE;
+  bool supportedDepth = bitDepth == 8 || (palettized && (bitDepth == 1 || bitDepth == 2 ||
+                                                         bitDepth == 4));
+  if (channels == 0 || !supportedDepth || width == 0 || height == 0 ||
+      width > PNG_USER_WIDTH_MAX || height > PNG_USER_HEIGHT_MAX) {
+    return Mat();
+  }
 
-    std::array<long, 4> sum = {0, 0, 0, 0};
-    for (const auto& color : assignedColors) {
-        for (int i = 0; i < 4; ++i) {
-            sum[i] += color[i];
-        }
+  const size_t rowBytes = (static_cast<size_t>(width) * channels * bitDepth + 7) / 8;
+  const int pixelBytes = std::max(1, channels * bitDepth / 8);
+  std::vector<u_int8_t> filtered(height * (rowBytes + 1));
+  libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
+  if (!decompressor) {
+    return Mat();
+  }
+  libdeflate_result inflated =
+      libdeflate_zlib_decompress(decompressor, idat.data(), idat.size(),
+                                 filtered.data(), filtered.size(), NULL);
+  libdeflate_free_decompressor(decompressor);
+  if (inflated != LIBDEFLATE_SUCCESS) {
+    return Mat();
+  }
+
+  // Palettes come out as RGB unless some entry is translucent
+  int outChannels = rgba ? 4 : palettized ? (hasTransparency ? 4 : 3) : channels;
+  Mat result(width, height, outChannels);
+  const u_int8_t *previous = NULL;
+  for (png_uint_32 y = 0; y < height; ++y) {
+    u_int8_t *row = &filtered[y * (rowBytes + 1)];
+    if (!unfilterRow(row + 1, previous, rowBytes, pixelBytes, row[0])) {
+      return Mat();
     }
+    previous = ++row;
 
-    for (int i = 0; i < 4; ++i) {
-        center[i] = sum[i] / assignedColors.size();
+    u_int8_t *out = result.row(y);
+    if (!palettized && outChannels == channels) {
+      std::memcpy(out, row, rowBytes);
+      continue;
+    }
+    switch (colorType) {
+    case PNG_COLOR_TYPE_RGB:
+      for (png_uint_32 x = 0; x < width; ++x, row += 3, out += 4) {
+        out[0] = row[0];
+        out[1] = row[1];
+        out[2] = row[2];
+        out[3] = 255;
+      }
+      break;
+    case PNG_COLOR_TYPE_GRAY:
+      for (png_uint_32 x = 0; x < width; ++x, out += 4) {
+        out[0] = out[1] = out[2] = row[x];
+        out[3] = 255;
+      }
+      break;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+      for (png_uint_32 x = 0; x < width; ++x, row += 2, out += 4) {
+        out[0] = out[1] = out[2] = row[0];
+        out[3] = row[1];
+      }
+      break;
+    default: {
+      // Indices are packed most significant bits first
+      int perByte = 8 / bitDepth;
+      int mask = (1 << bitDepth) - 1;
+      for (png_uint_32 x = 0; x < width; ++x, out += outChannels) {
+        int shift = 8 - bitDepth * (x % perByte + 1);
+        std::memcpy(out, palette[(row[x / perByte] >> shift) & mask].data(),
+                    outChannels);
+      }
+      break;
+    }
     }
+  }
+  return result;
 }
 
-void runKmeans(Mat& image, int K, int N) {
-    std::vector<Color> centers(K);
-    for (int i = 0; i < K; ++i) {
-        initializeCenter(centers[i], image);
-    }
+// Filters every row on the worker pool and deflates the whole image into a
+// single IDAT. rows returns row y, building it in scratch when it has to.
+// libdeflate has no strategies, the profiles only pick level and filters,
+// with its level 12 for the smallest profile.
+std::variant<Success, Error> writePngDeflate(
+    FILE *fp, const PngLayout &layout,
+    const std::function<const u_int8_t *(int y, u_int8_t *scratch)> &rows,
+    PngEncoding &encoding) {
+  auto start = std::chrono::steady_clock::now();
+  DeflateSettings settings =
+      encodeSettings(encoding.profile, layout.colorType == PNG_COLOR_TYPE_PALETTE);
+  int level = encoding.profile == PNG_ENCODE_SMALLEST ? 12
+              : settings.level == Z_DEFAULT_COMPRESSION ? 6
+                                                        : settings.level;
 
-    for (int iteration = 0; iteration < N; ++iteration) {
-        std::vector<std::vector<Color>> clusters(K); // Each cluster holds assigned colors
+  const size_t filteredBytes = layout.rowBytes + 1;
+  std::vector<u_int8_t> filtered(layout.height * filteredBytes);
+  parallelRows(layout.height, [&](int y) {
+    thread_local std::vector<u_int8_t> scratch;
+    thread_local std::vector<u_int8_t> previousScratch;
+    scratch.resize(layout.rowBytes);
+    previousScratch.resize(layout.rowBytes);
+    const u_int8_t *row = rows(y, scratch.data());
+    const u_int8_t *previous = y > 0 ? rows(y - 1, previousScratch.data()) : NULL;
+    filterRow(row, previous, layout.rowBytes, layout.pixelBytes, settings.filters,
+              filtered.data() + y * filteredBytes);
+  });
 
-        // Assign pixels to the nearest center
-        for (const auto& row : image) {
-            for (const auto& pixel : row) {
-                size_t centerIndex = findClosestCenterIndex(centers, pixel);
-                clusters[centerIndex].push_back(pixel);
-            }
-        }
+  libdeflate_compressor *compressor = libdeflate_alloc_compressor(level);
+  if (!compressor) {
+    return Error("Failed to create deflate compressor.");
+  }
+  std::vector<u_int8_t> deflated(
+      libdeflate_zlib_compress_bound(compressor, filtered.size()));
+  size_t deflatedBytes =
+      libdeflate_zlib_compress(compressor, filtered.data(), filtered.size(),
+                               deflated.data(), deflated.size());
+  libdeflate_free_compressor(compressor);
+  if (deflatedBytes == 0) {
+    return Error("Failed to deflate PNG rows.");
+  }
 
-        // Update centers
-        for (int i = 0; i < K; ++i) {
-            updateCenter(centers[i], clusters[i]);
-        }
-    }
+  bool ok = writePngHeader(fp, layout) &&
+            writeChunk(fp, "IDAT", {{deflated.data(), deflatedBytes}}) &&
+            writeChunk(fp, "IEND", {});
+  if (!ok) {
+    return Error("Failed to write PNG.");
+  }
 
-    // Optionally: Assign pixels in the image to their cluster's center color
-    for (auto& row : image) {
-        for (auto& pixel : row) {
-            int centerIndex = findClosestCenterIndex(centers, pixel);
-            pixel = centers[centerIndex];
-        }
-    }
+  encoding.elapsed += std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  return Success(true);
 }
+#endif
 
-std::variant<Mat, Error> readPng(const char *imagePath) {
-  FILE *fp = fopen(imagePath, "rb");
-  if (!fp) {
+// Box resize from one PNG file to another without holding either image in
+// memory. Source rows are pulled one at a time and folded into the column
+// sums of every output row whose block they fall in, each output row is
+// written as soon as its last source row has been read. Only a few rows are
+// alive at once, the output is identical to readPng + resize + writePng,
+// in the channels of the source plus alpha when the result is padded.
+// Returns Success(false) without writing anything when the source is
+// interlaced, those can only be decoded as a whole image. Only the calls into
+// the encoder count towards encoding.elapsed. Large outputs go through
+// ChunkedPngWriter, which holds one batch of bands instead of a few rows.
+// When scaled is not NULL the output rows are also kept there, for callers
+// that go on working on the resized image.
+std::variant<Success, Error> scalePngStreaming(const char *imagePath,
+                                               const char *newImagePath,
+                                               int newWidth, int newHeight,
+                                               PngEncoding &encoding,
+                                               Mat *scaled) {
+  // Everything that changes after the setjmps below lives behind rows, a
+  // longjmp back to them would otherwise leave these locals indeterminate
+  // for their destructors
+  struct StreamingRows {
+    std::vector<u_int8_t> source;
+    std::vector<u_int8_t> output;
+    std::vector<u_int8_t> padding;
+    std::deque<BoxColumnSums> active; // Output rows [first, next)
+    std::vector<BoxColumnSums> spare;
+    std::unique_ptr<ChunkedPngWriter> chunked;
+    ReplacingFile out;
+  };
+  const auto rows = std::make_unique<StreamingRows>();
+
+  FILE *in = fopen(imagePath, "rb");
+  if (!in) {
     return Error("File could not be opened for reading");
   }
 
   png_structp png =
       png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   if (!png) {
-    fclose(fp);
+    fclose(in);
     return Error("Failed to create PNG read structure");
   }
 
   png_infop info = png_create_info_struct(png);
   if (!info) {
     png_destroy_read_struct(&png, NULL, NULL);
-    fclose(fp);
+    fclose(in);
     return Error("Failed to create PNG info structure");
   }
 
+  // Created ahead of the setjmp below for its handler to clean up, even
+  // though large outputs end up going through the chunked writer instead
+  png_structp png_out =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info_out = png_out ? png_create_info_struct(png_out) : NULL;
+  if (!info_out) {
+    png_destroy_write_struct(&png_out, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(in);
+    return Error("Failed to create PNG write structure.");
+  }
+
   if (setjmp(png_jmpbuf(png))) {
     png_destroy_read_struct(&png, &info, NULL);
-    fclose(fp);
+    png_destroy_write_struct(&png_out, &info_out);
+    fclose(in);
     return Error("Error during PNG creation");
   }
 
-  png_init_io(png, fp);
+  png_init_io(png, in);
   png_read_info(png, info);
 
+  if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+    png_destroy_read_struct(&png, &info, NULL);
+    png_destroy_write_struct(&png_out, &info_out);
+    fclose(in);
+    return Success(false);
+  }
+
   int width = png_get_image_width(png, info);
   int height = png_get_image_height(png, info);
-  png_byte color_type = png_get_color_type(png, info);
-  png_byte bit_depth = png_get_bit_depth(png, info);
-
-  // Convert PNG to a format we can work with
-  if (bit_depth == 16)
-    png_set_strip_16(png);
-
-  if (color_type == PNG_COLOR_TYPE_PALETTE)
-    png_set_palette_to_rgb(png);
-
-  // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
-  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-    png_set_expand_gray_1_2_4_to_8(png);
-
-  if (png_get_valid(png, info, PNG_INFO_tRNS))
-    png_set_tRNS_to_alpha(png);
-
-  // These color_type don't have an alpha channel then fill it with 0xff.
-  if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY ||
-      color_type == PNG_COLOR_TYPE_PALETTE)
-    png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+  BoxLayout layout = computeBoxLayout(width, height, newWidth, newHeight);
 
-  if (color_type == PNG_COLOR_TYPE_GRAY ||
-      color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-    png_set_gray_to_rgb(png);
+  // Rows keep the channels of the source. Letterbox padding is transparent,
+  // a source without alpha gets an opaque one when the output is padded.
+  bool padded = layout.effectiveWidth != newWidth || layout.effectiveHeight != newHeight;
+  setDecodeTransforms(png, info, padded, false);
+  const int channels = png_get_channels(png, info);
+  if (useChunkedDeflate(static_cast<size_t>(newWidth) * newHeight * channels)) {
+    PngLayout pngLayout;
+    pngLayout.width = newWidth;
+    pngLayout.height = newHeight;
+    pngLayout.bitDepth = 8;
+    pngLayout.colorType = pngColorType(channels);
+    pngLayout.rowBytes = static_cast<size_t>(newWidth) * channels;
+    pngLayout.pixelBytes = channels;
+    rows->chunked.reset(new ChunkedPngWriter(pngLayout, encoding.profile));
+  }
+  if (scaled) {
+    *scaled = Mat(newWidth, newHeight, channels);
+  }
 
-  png_read_update_info(png, info);
+  rows->source.resize(png_get_rowbytes(png, info));
+  rows->output.assign(static_cast<size_t>(newWidth) * channels, 0);
+  rows->padding.assign(static_cast<size_t>(newWidth) * channels, 0);
 
-  Mat result(height, std::vector<Color>(width));
-  png_bytep *row_pointers = (png_bytep *)malloc(sizeof(png_bytep) * height);
-  for (int y = 0; y < height; y++) {
-    row_pointers[y] = (png_byte *)malloc(png_get_rowbytes(png, info));
+  if (!rows->out.open(newImagePath)) {
+    png_destroy_read_struct(&png, &info, NULL);
+    png_destroy_write_struct(&png_out, &info_out);
+    fclose(in);
+    return Error("File could not be opened for writing.");
   }
 
-  png_read_image(png, row_pointers);
+  auto encodeStart = std::chrono::steady_clock::now();
+  auto timeEncoder = [&]() {
+    auto now = std::chrono::steady_clock::now();
+    encoding.elapsed +=
+        std::chrono::duration_cast<std::chrono::microseconds>(now - encodeStart);
+  };
+  volatile int rowsWritten = 0; // Updated after the setjmp above
+  auto writeRow = [&](u_int8_t *row) {
+    if (scaled) {
+      std::memcpy(scaled->row(rowsWritten++), row, rows->output.size());
+    }
+    if (rows->chunked) {
+      rows->chunked->writeRow(row);
+      return;
+    }
+    encodeStart = std::chrono::steady_clock::now();
+    png_write_row(png_out, row);
+    timeEncoder();
+  };
 
-  // Convert each pixel to grayscale
-  for (int y = 0; y < height; y++) {
-    png_bytep row = row_pointers[y];
-    for (int x = 0; x < width; x++) {
-      png_bytep px = &(row[x * 4]); // PNG is RGBA
-      // Simple luminosity formula: 0.3 R + 0.59 G + 0.11 B
-      result[y][x][0] = px[0];
-      result[y][x][1] = px[1];
-      result[y][x][2] = px[2];
-      result[y][x][3] = px[3];
+  if (rows->chunked) {
+    // A failed header is reported by finish()
+    rows->chunked->begin(rows->out.file());
+  } else {
+    if (setjmp(png_jmpbuf(png_out))) {
+      png_destroy_read_struct(&png, &info, NULL);
+      png_destroy_write_struct(&png_out, &info_out);
+      fclose(in);
+      return Error("Error during PNG creation.");
     }
-    free(row_pointers[y]);
+
+    encodeStart = std::chrono::steady_clock::now();
+    png_init_io(png_out, rows->out.file());
+    png_set_IHDR(png_out, info_out, newWidth, newHeight, 8, pngColorType(channels),
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    setEncodeProfile(png_out, encoding.profile, false);
+    png_write_info(png_out, info_out);
+    timeEncoder();
   }
-  free(row_pointers);
 
-  png_destroy_read_struct(&png, &info, NULL);
-  fclose(fp);
+  for (int y = 0; y < layout.offsetY; ++y) {
+    writeRow(rows->padding.data());
+  }
 
-  return result;
-}
-// Function to calculate the mean color of a specific area in the image
-Color calculateMeanColor(const Mat& image, int startX, int startY, int endX, int endY) {
-    unsigned long long total[4] = {0}; // Accumulate sums for each channel
-    int count = 0; // Number of pixels in the specified area
-    
-    // Iterate over the specified area and accumulate the color values
-    for (int y = startY; y < endY; ++y) {
-        for (int x = startX; x < endX; ++x) {
-            // Add up the color channels for each pixel in the area
-            for (int c = 0; c < 4; ++c) {
-                total[c] += image[y][x][c];
-            }
-            ++count; // Increment pixel count
-        }
-    }
-    
-    // Calculate mean color values
-    Color meanColor;
-    if (count > 0) { // Ensure division by zero is not possible
-        for (int c = 0; c < 4; ++c) {
-            meanColor[c] = static_cast<u_int8_t>(total[c] / count);
-        }
+  int first = 0;
+  int next = 0;
+  auto finishRow = [&]() {
+    rows->active.front().emitRow(rows->output.data() + layout.offsetX * channels);
+    writeRow(rows->output.data());
+    rows->spare.push_back(std::move(rows->active.front()));
+    rows->active.pop_front();
+    ++first;
+  };
+  auto startRow = [&]() {
+    if (rows->spare.empty()) {
+      rows->active.emplace_back(layout, channels);
     } else {
-        // In case the specified area has no pixels, return a default color (e.g., transparent)
-        meanColor = {0, 0, 0, 0}; // Assuming a fully transparent pixel as default
+      rows->active.push_back(std::move(rows->spare.back()));
+      rows->spare.pop_back();
+      rows->active.back().clear();
     }
-    
-    return meanColor;
-}
-// Resize the image to newWidth x newHeight
-// using the mean of the pixels in the area
-// of the original image that maps to each pixel
-// also, keeps the aspect ratio by adding 0 alpha padding
-Mat resize(Mat image, int newWidth, int newHeight) {
-    int originalHeight = image.size();
-    int originalWidth = image[0].size();
+    ++next;
+  };
 
-    // Calculate aspect ratios
-    float originalAspect = static_cast<float>(originalWidth) / originalHeight;
-    float newAspect = static_cast<float>(newWidth) / newHeight;
+  for (int y = 0; y < height; ++y) {
+    png_read_row(png, rows->source.data(), NULL);
 
-    // Calculate effective width and height after considering aspect ratio
-    int effectiveWidth, effectiveHeight;
-    if (originalAspect > newAspect) {
-        // Width is the limiting dimension
-        effectiveWidth = newWidth;
-        effectiveHeight = static_cast<int>(newWidth / originalAspect);
-    } else {
-        // Height is the limiting dimension
-        effectiveWidth = static_cast<int>(newHeight * originalAspect);
-        effectiveHeight = newHeight;
+    while (next < layout.effectiveHeight && layout.startY(next) <= y) {
+      startRow();
     }
+    for (int i = first; i < next; ++i) {
+      if (y < layout.endY(i)) {
+        rows->active[i - first].addRow(rows->source.data());
+      }
+    }
+    while (first < next && layout.endY(first) <= y + 1) {
+      finishRow();
+    }
+  }
 
-    // Initialize new image with padding if necessary
-    Mat newImage(newHeight, std::vector<Color>(newWidth, {0, 0, 0, 0})); // Default to transparent for padding
-
-    float xRatio = static_cast<float>(originalWidth) / effectiveWidth;
-    float yRatio = static_cast<float>(originalHeight) / effectiveHeight;
+  // Rows whose block starts past the last source row come out transparent
+  while (first < layout.effectiveHeight) {
+    if (first == next) {
+      startRow();
+    }
+    finishRow();
+  }
 
-    for (int i = 0; i < effectiveHeight; i++) {
-        for (int j = 0; j < effectiveWidth; j++) {
-            int startY = static_cast<int>(i * yRatio);
-            int startX = static_cast<int>(j * xRatio);
-            int endY = std::min(static_cast<int>((i + 1) * yRatio + 1), originalHeight);
-            int endX = std::min(static_cast<int>((j + 1) * xRatio + 1), originalWidth);
+  for (int y = layout.offsetY + layout.effectiveHeight; y < newHeight; ++y) {
+    writeRow(rows->padding.data());
+  }
 
-            Color meanColor = calculateMeanColor(image, startX, startY, endX, endY);
+  if (!rows->chunked) {
+    encodeStart = std::chrono::steady_clock::now();
+    png_write_end(png_out, NULL);
+    timeEncoder();
+  }
 
-            // Place the calculated mean color in the new image, adjusting position for any padding
-            int newY = i + (newHeight - effectiveHeight) / 2; // Adjust for vertical padding
-            int newX = j + (newWidth - effectiveWidth) / 2; // Adjust for horizontal padding
-            newImage[newY][newX] = meanColor;
-        }
-    }
+  // Past the last libpng call that can jump back
+  std::variant<Success, Error> result = Success(true);
+  if (rows->chunked) {
+    result = rows->chunked->finish(encoding);
+  }
+  png_destroy_read_struct(&png, &info, NULL);
+  png_destroy_write_struct(&png_out, &info_out);
+  fclose(in);
+  if (std::holds_alternative<Success>(result) && !rows->out.commit()) {
+    result = Error("Failed to write PNG.");
+  }
 
-    return newImage;
+  return result;
 }
 
-std::variant<Success, Error> writePng(const char *imagePath, const Mat &image) {
-  FILE *fp = fopen(imagePath, "wb");
-  if (!fp) {
-    return Error("File could not be opened for writing.");
+// Destination for size bytes in buffer, malloc'd when the caller left data
+// NULL. Returns NULL when the caller's memory is too small or allocation
+// fails, size holds the bytes needed either way.
+unsigned char *reserveBuffer(ImageBuffer *buffer, size_t size) {
+  buffer->size = size;
+  if (!buffer->data) {
+    buffer->data = static_cast<unsigned char *>(malloc(size));
+    buffer->capacity = buffer->data ? size : 0;
+    return buffer->data;
   }
+  return size <= buffer->capacity ? buffer->data : NULL;
+}
 
-  png_structp png_ptr =
-      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (!png_ptr) {
-    fclose(fp);
-    return Error("Failed to create PNG write structure.");
+// Runs write on the file or memory stream behind output. Memory output goes
+// to the caller's buffer without a copy when the library allocates it.
+std::variant<Success, Error>
+writeOutput(const PngOutput &output,
+            const std::function<std::variant<Success, Error>(FILE *fp)> &write) {
+  if (output.path) {
+    ReplacingFile file;
+    if (!file.open(output.path)) {
+      return Error("File could not be opened for writing.");
+    }
+    auto result = write(file.file());
+    if (std::holds_alternative<Success>(result) && !file.commit()) {
+      return Error("Failed to write PNG.");
+    }
+    return result;
   }
 
-  png_infop info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr) {
-    png_destroy_write_struct(&png_ptr, NULL);
-    fclose(fp);
-    return Error("Failed to create PNG info structure.");
+  char *data = NULL;
+  size_t size = 0;
+  FILE *fp = open_memstream(&data, &size);
+  if (!fp) {
+    return Error("Failed to create memory stream.");
   }
-
-  if (setjmp(png_jmpbuf(png_ptr))) {
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    fclose(fp);
-    return Error("Error during PNG creation.");
+  auto result = write(fp);
+  if (fclose(fp) != 0 && std::holds_alternative<Success>(result)) {
+    result = Error("Failed to write PNG.");
+  }
+  if (std::holds_alternative<Error>(result)) {
+    free(data);
+    return result;
   }
 
-  png_init_io(png_ptr, fp);
+  ImageBuffer *buffer = output.buffer;
+  if (!buffer->data) {
+    buffer->data = reinterpret_cast<unsigned char *>(data);
+    buffer->size = size;
+    buffer->capacity = size;
+    return Success(true);
+  }
+  unsigned char *target = reserveBuffer(buffer, size);
+  if (target) {
+    std::memcpy(target, data, size);
+  }
+  free(data);
+  if (!target) {
+    return Error("Output buffer is too small.");
+  }
+  return Success(true);
+}
 
-  int bit_depth = 8;
-  int color_type = PNG_COLOR_TYPE_RGBA;
-  int width = image[0].size();
-  int height = image.size();
+// Resize of a decoded image, shared by the path and buffer entry points.
+// When scaled is not NULL the resized image is also kept there.
+bool scaleDecoded(std::variant<Mat, Error> &image, int newWidth, int newHeight,
+                  ScaleFilter filter, const PngOutput &output,
+                  PngEncoding &encoding, Mat *scaled) {
+  if (std::holds_alternative<Error>(image)) {
+    fprintf(stderr, "Error: %s\n", std::get<Error>(image).c_str());
+    return false;
+  }
+  const Mat &imageMat = std::get<Mat>(image);
+  Mat newImageMat = resample(imageMat, newWidth, newHeight, filter);
+  auto result = writeOutput(
+      output, [&](FILE *fp) { return writePng(fp, newImageMat, encoding); });
 
-  png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type,
-               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-               PNG_FILTER_TYPE_DEFAULT);
+  if (std::holds_alternative<Error>(result)) {
+    fprintf(stderr, "Error: %s\n", std::get<Error>(result).c_str());
+    return false;
+  }
+  if (scaled) {
+    *scaled = std::move(newImageMat);
+  }
+  return true;
+}
 
-  png_write_info(png_ptr, info_ptr);
+bool scaleImage(const char *imagePath, const char *newImagePath, int newWidth,
+                int newHeight) {
+  return scaleImageWithOptions(imagePath, newImagePath, newWidth, newHeight,
+                               NULL, NULL);
+}
 
-  // Allocate memory for rows
-  png_bytep row = (png_bytep)malloc(4 * width * sizeof(png_byte));
-  if (!row) {
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    fclose(fp);
-    return Error("Failed to allocate memory for PNG row.");
+bool scaleImageWithOptions(const char *imagePath, const char *newImagePath,
+                           int newWidth, int newHeight,
+                           const ScaleOptions *options, ScaleReport *report) {
+  PngEncoding encoding;
+  if (options) {
+    encoding.profile = options->encodeProfile;
   }
+  auto reportEncoding = [&]() {
+    if (report) {
+      report->encodeProfile = encoding.profile;
+      report->encodeMicros = encoding.elapsed.count();
+    }
+  };
 
-  // Write image data
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      row[x * 4 + 0] = static_cast<png_byte>(image[y][x][0]); // Red
-      row[x * 4 + 1] = static_cast<png_byte>(image[y][x][1]); // Green
-      row[x * 4 + 2] = static_cast<png_byte>(image[y][x][2]); // Blue
-      row[x * 4 + 3] = static_cast<png_byte>(image[y][x][3]); // Alpha
+  ScaleFilter filter = options ? options->filter : SCALE_FILTER_BOX;
+  if (filter == SCALE_FILTER_BOX) {
+    auto streamed = scalePngStreaming(imagePath, newImagePath, newWidth,
+                                      newHeight, encoding, NULL);
+    if (std::holds_alternative<Error>(streamed)) {
+      fprintf(stderr, "Error: %s\n", std::get<Error>(streamed).c_str());
+      return false;
+    }
+    if (std::get<Success>(streamed)) {
+      reportEncoding();
+      return true;
     }
-    png_write_row(png_ptr, row);
   }
 
-  png_write_end(png_ptr, NULL);
+  // Interlaced source or a separable filter, decode it whole
+  auto image = readPng(imagePath, false);
+  PngOutput output;
+  output.path = newImagePath;
+  if (!scaleDecoded(image, newWidth, newHeight, filter, output, encoding, NULL)) {
+    return false;
+  }
+  reportEncoding();
+  return true;
+}
 
-  // Cleanup
-  free(row);
-  png_destroy_write_struct(&png_ptr, &info_ptr);
-  fclose(fp);
+bool scaleImageBuffer(const unsigned char *png, size_t pngSize, int newWidth,
+                      int newHeight, const ScaleOptions *options,
+                      ImageBuffer *output, ScaleReport *report) {
+  PngEncoding encoding;
+  if (options) {
+    encoding.profile = options->encodeProfile;
+  }
+  auto image = decodePng(png, pngSize, false);
+  PngOutput target;
+  target.buffer = output;
+  ScaleFilter filter = options ? options->filter : SCALE_FILTER_BOX;
+  if (!scaleDecoded(image, newWidth, newHeight, filter, target, encoding, NULL)) {
+    return false;
+  }
+  if (report) {
+    report->encodeProfile = encoding.profile;
+    report->encodeMicros = encoding.elapsed.count();
+  }
+  return true;
+}
 
-  return Success(true);
+const char *pngDeflateBackend() {
+#ifdef USE_LIBDEFLATE
+  return "libdeflate";
+#else
+  return "zlib";
+#endif
 }
 
-bool scaleImage(const char *imagePath, const char *newImagePath, int newWidth,
-                int newHeight) {
-  auto image = readPng(imagePath);
+bool transcodeImage(const char *imagePath, const char *newImagePath,
+                    PngEncodeProfile encodeProfile, TranscodeReport *report) {
+  auto start = std::chrono::steady_clock::now();
+  auto image = readPng(imagePath, true);
+  auto decoded = std::chrono::steady_clock::now();
   if (std::holds_alternative<Error>(image)) {
     fprintf(stderr, "Error: %s\n", std::get<Error>(image).c_str());
     return false;
   }
-  Mat imageMat = std::get<Mat>(image);
-  Mat newImageMat = resize(imageMat, newWidth, newHeight);
-  auto result = writePng(newImagePath, newImageMat);
+  const Mat &imageMat = std::get<Mat>(image);
 
+  PngEncoding encoding;
+  encoding.profile = encodeProfile;
+  PngOutput output;
+  output.path = newImagePath;
+  auto result = writeOutput(
+      output, [&](FILE *fp) { return writePng(fp, imageMat, encoding); });
   if (std::holds_alternative<Error>(result)) {
     fprintf(stderr, "Error: %s\n", std::get<Error>(result).c_str());
     return false;
   }
 
+  if (report) {
+    report->width = imageMat.width;
+    report->height = imageMat.height;
+    report->decodeMicros =
+        std::chrono::duration_cast<std::chrono::microseconds>(decoded - start).count();
+    report->encodeMicros = encoding.elapsed.count();
+  }
   return true;
 }
 
 // Quantize the image to N colors using k-means
 bool quantizeImage(const char *imagePath, const char *newImagePath, int N) {
+  return quantizeImageWithOptions(imagePath, newImagePath, N, NULL, NULL);
+}
+
+bool quantizeImageWithOptions(const char *imagePath, const char *newImagePath,
+                              int N, const QuantizeOptions *options,
+                              QuantizeReport *report) {
+  auto image = readPng(imagePath, true);
+  PngOutput output;
+  output.path = newImagePath;
+  return quantizeDecoded(image, N, options, output, report);
+}
+
+bool quantizeImageBuffer(const unsigned char *png, size_t pngSize, int N,
+                         const QuantizeOptions *options, ImageBuffer *output,
+                         QuantizeReport *report) {
+  auto image = decodePng(png, pngSize, true);
+  PngOutput target;
+  target.buffer = output;
+  return quantizeDecoded(image, N, options, target, report);
+}
 
-  // Read the image
-  auto image = readPng(imagePath);
+// Quantization of a decoded image, shared by the path and buffer entry points
+bool quantizeDecoded(std::variant<Mat, Error> &image, int N,
+                     const QuantizeOptions *options, const PngOutput &output,
+                     QuantizeReport *report) {
   if (std::holds_alternative<Error>(image)) {
     fprintf(stderr, "Error: %s\n", std::get<Error>(image).c_str());
     return false;
   }
-  Mat imageMat = std::get<Mat>(image);
-  runKmeans(imageMat, N, 50);
+  // The quantizer works on RGBA, scaled images keep the source channels
+  Mat &imageMat = std::get<Mat>(image);
+  if (imageMat.channels != 4) {
+    imageMat = expandToRgba(imageMat);
+  }
+  const QuantizeOptions quantizeOptions = options ? *options : QuantizeOptions{};
+  std::vector<Color> palette;
+  QuantizeReport kmeansReport = quantizeMat(imageMat, N, quantizeOptions, palette);
 
-  // Write the new image
-  auto result = writePng(newImagePath, imageMat);
+  // Write the new image, as a palette PNG whenever the colors fit in one
+  PngEncoding encoding;
+  encoding.profile = quantizeOptions.encodeProfile;
+  std::variant<Success, Error> result;
+  if (palette.size() <= 256) {
+    IndexedImage indexed = indexImage(imageMat, palette);
+    result = writeOutput(
+        output, [&](FILE *fp) { return writeIndexedPng(fp, indexed, encoding); });
+  } else {
+    remapImage(imageMat, palette);
+    result = writeOutput(
+        output, [&](FILE *fp) { return writePng(fp, imageMat, encoding); });
+  }
   if (std::holds_alternative<Error>(result)) {
     fprintf(stderr, "Error: %s\n", std::get<Error>(result).c_str());
     return false;
   }
 
+  if (report) {
+    *report = kmeansReport;
+    report->encodeProfile = encoding.profile;
+    report->encodeMicros = encoding.elapsed.count();
+  }
+  return true;
+}
+
+// Both outputs of a scale then quantize of the scaled file, with one decode
+bool scaleQuantizeImage(const char *imagePath, const char *scaledImagePath,
+                        const char *quantizedImagePath, int newWidth,
+                        int newHeight, int N, const ScaleOptions *scaleOptions,
+                        const QuantizeOptions *quantizeOptions,
+                        ScaleReport *scaleReport,
+                        QuantizeReport *quantizeReport) {
+  PngEncoding encoding;
+  if (scaleOptions) {
+    encoding.profile = scaleOptions->encodeProfile;
+  }
+
+  // The streaming resize hands back the rows it wrote, the quantizer starts
+  // from those instead of decoding the scaled file again
+  Mat scaledMat;
+  ScaleFilter filter = scaleOptions ? scaleOptions->filter : SCALE_FILTER_BOX;
+  bool streamed = false;
+  if (filter == SCALE_FILTER_BOX) {
+    auto result = scalePngStreaming(imagePath, scaledImagePath, newWidth,
+                                    newHeight, encoding, &scaledMat);
+    if (std::holds_alternative<Error>(result)) {
+      fprintf(stderr, "Error: %s\n", std::get<Error>(result).c_str());
+      return false;
+    }
+    streamed = std::get<Success>(result);
+  }
+  if (!streamed) {
+    // Interlaced source or a separable filter, decode it whole
+    auto image = readPng(imagePath, false);
+    PngOutput output;
+    output.path = scaledImagePath;
+    if (!scaleDecoded(image, newWidth, newHeight, filter, output, encoding,
+                      &scaledMat)) {
+      return false;
+    }
+  }
+  if (scaleReport) {
+    scaleReport->encodeProfile = encoding.profile;
+    scaleReport->encodeMicros = encoding.elapsed.count();
+  }
+
+  std::variant<Mat, Error> scaled = std::move(scaledMat);
+  PngOutput output;
+  output.path = quantizedImagePath;
+  return quantizeDecoded(scaled, N, quantizeOptions, output, quantizeReport);
+}
+
+bool scaleQuantizeImageBuffer(const unsigned char *png, size_t pngSize,
+                              int newWidth, int newHeight, int N,
+                              const ScaleOptions *scaleOptions,
+                              const QuantizeOptions *quantizeOptions,
+                              ImageBuffer *scaledOutput,
+                              ImageBuffer *quantizedOutput,
+                              ScaleReport *scaleReport,
+                              QuantizeReport *quantizeReport) {
+  PngEncoding encoding;
+  if (scaleOptions) {
+    encoding.profile = scaleOptions->encodeProfile;
+  }
+  auto image = decodePng(png, pngSize, false);
+  PngOutput scaledTarget;
+  scaledTarget.buffer = scaledOutput;
+  ScaleFilter filter = scaleOptions ? scaleOptions->filter : SCALE_FILTER_BOX;
+  Mat scaledMat;
+  if (!scaleDecoded(image, newWidth, newHeight, filter, scaledTarget, encoding,
+                    &scaledMat)) {
+    return false;
+  }
+  if (scaleReport) {
+    scaleReport->encodeProfile = encoding.profile;
+    scaleReport->encodeMicros = encoding.elapsed.count();
+  }
+
+  std::variant<Mat, Error> scaled = std::move(scaledMat);
+  PngOutput quantizedTarget;
+  quantizedTarget.buffer = quantizedOutput;
+  return quantizeDecoded(scaled, N, quantizeOptions, quantizedTarget,
+                         quantizeReport);
+}
+
+// Smallest step between two ladder levels cut from one another. Every box
+// also takes in the pixel after it and every level rounds down, over a
+// box of only a few pixels of a level both show as blur and darkening.
+constexpr int ladderCascadeFactor = 8;
+
+// Every target from one decode of imagePath
+bool scaleImageLadder(const char *imagePath, const ScaleTarget *targets,
+                      int count, const ScaleOptions *options,
+                      ScaleReport *reports) {
+  auto image = readPng(imagePath, false);
+  std::vector<PngOutput> outputs(count);
+  for (int i = 0; i < count; ++i) {
+    outputs[i].path = targets[i].imagePath;
+  }
+  return scaleLadderDecoded(image, targets, count, options, outputs, reports);
+}
+
+bool scaleImageLadderBuffer(const unsigned char *png, size_t pngSize,
+                            const ScaleTarget *targets, int count,
+                            const ScaleOptions *options, ImageBuffer *outputs,
+                            ScaleReport *reports) {
+  auto image = decodePng(png, pngSize, false);
+  std::vector<PngOutput> targetOutputs(count);
+  for (int i = 0; i < count; ++i) {
+    targetOutputs[i].buffer = &outputs[i];
+  }
+  return scaleLadderDecoded(image, targets, count, options, targetOutputs, reports);
+}
+
+// The ladder of a decoded image, shared by the path and buffer entry points.
+// Targets are scaled largest first, each from the smallest level already
+// done that is at least ladderCascadeFactor times its size, the original
+// otherwise. The resizes are cheap next to the encodes, which run in
+// parallel once all are done.
+bool scaleLadderDecoded(std::variant<Mat, Error> &image, const ScaleTarget *targets,
+                        int count, const ScaleOptions *options,
+                        const std::vector<PngOutput> &outputs, ScaleReport *reports) {
+  if (std::holds_alternative<Error>(image)) {
+    fprintf(stderr, "Error: %s\n", std::get<Error>(image).c_str());
+    return false;
+  }
+  const Mat &source = std::get<Mat>(image);
+
+  std::vector<BoxLayout> layouts(count);
+  std::vector<int> order(count);
+  for (int i = 0; i < count; ++i) {
+    layouts[i] = computeBoxLayout(source.width, source.height, targets[i].width,
+                                  targets[i].height);
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return static_cast<long long>(layouts[a].effectiveWidth) * layouts[a].effectiveHeight >
+           static_cast<long long>(layouts[b].effectiveWidth) * layouts[b].effectiveHeight;
+  });
+
+  // Levels hold only the picture part of every target, padImage adds the
+  // padding when encoding, so a level keeps the channels of the source
+  ScaleFilter filter = options ? options->filter : SCALE_FILTER_BOX;
+  std::vector<Mat> scaled(count);
+  for (size_t k = 0; k < order.size(); ++k) {
+    int i = order[k];
+    BoxLayout layout = layouts[i];
+    layout.offsetX = 0;
+    layout.offsetY = 0;
+    int from = -1;
+    for (size_t done = 0; done < k; ++done) {
+      const BoxLayout &level = layouts[order[done]];
+      if (level.effectiveWidth >= layout.effectiveWidth * ladderCascadeFactor &&
+          level.effectiveHeight >= layout.effectiveHeight * ladderCascadeFactor) {
+        from = order[done];
+      }
+    }
+    if (from < 0) {
+      scaled[i] = resampleWithLayout(source, layout, layout.effectiveWidth,
+                                     layout.effectiveHeight, filter);
+      continue;
+    }
+
+    const BoxLayout &level = layouts[from];
+    layout.originalWidth = level.effectiveWidth;
+    layout.originalHeight = level.effectiveHeight;
+    layout.xRatio = static_cast<float>(level.effectiveWidth) / layout.effectiveWidth;
+    layout.yRatio = static_cast<float>(level.effectiveHeight) / layout.effectiveHeight;
+    scaled[i] = resampleWithLayout(scaled[from], layout, layout.effectiveWidth,
+                                   layout.effectiveHeight, filter);
+  }
+
+  std::atomic<bool> success{true};
+  workerPool().parallelFor(count, [&](size_t i) {
+    PngEncoding encoding;
+    if (options) {
+      encoding.profile = options->encodeProfile;
+    }
+    auto result = writeOutput(
+        outputs[i], [&](FILE *fp) {
+          return writePng(fp,
+                          padImage(scaled[i], layouts[i], targets[i].width,
+                                   targets[i].height),
+                          encoding);
+        });
+    if (std::holds_alternative<Error>(result)) {
+      fprintf(stderr, "Error: %s\n", std::get<Error>(result).c_str());
+      success = false;
+      return;
+    }
+    if (reports) {
+      reports[i].encodeProfile = encoding.profile;
+      reports[i].encodeMicros = encoding.elapsed.count();
+    }
+  });
+  return success;
+}
+
+bool decodeImageBuffer(const unsigned char *png, size_t pngSize,
+                       ImageBuffer *rgba, int *width, int *height) {
+  auto image = decodePng(png, pngSize, true);
+  if (std::holds_alternative<Error>(image)) {
+    fprintf(stderr, "Error: %s\n", std::get<Error>(image).c_str());
+    return false;
+  }
+  const Mat &imageMat = std::get<Mat>(image);
+  *width = imageMat.width;
+  *height = imageMat.height;
+
+  // Mat rows are padded to their alignment, the caller gets them packed
+  size_t rowBytes = static_cast<size_t>(imageMat.width) * 4;
+  unsigned char *pixels = reserveBuffer(rgba, rowBytes * imageMat.height);
+  if (!pixels) {
+    fprintf(stderr, "Error: Output buffer is too small.\n");
+    return false;
+  }
+  for (int y = 0; y < imageMat.height; ++y) {
+    std::memcpy(pixels + y * rowBytes, imageMat.row(y), rowBytes);
+  }
   return true;
 }
 
+void freeImageBuffer(ImageBuffer *buffer) {
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->size = 0;
+  buffer->capacity = 0;
+}
+
 #ifdef TESTING
 
 int main() {
@@ -392,8 +4244,10 @@ int main() {
   bool result = scaleImage(imagePath, newImagePath, 500, 300);
   printf("Scale Result: %d\n", result);
   char reducedColorImagePath[] = "reducedColorImage.png";
-  result = quantizeImage(newImagePath, reducedColorImagePath, 8);
-  printf("Quantize Result: %d\n", result);
+  QuantizeReport report;
+  result = quantizeImageWithOptions(newImagePath, reducedColorImagePath, 8,
+                                    NULL, &report);
+  printf("Quantize Result: %d (%d iterations)\n", result, report.iterations);
   return 0;
 }
 #endif
@@ -1,10 +1,169 @@
 #ifndef EXAMPLE_H
 #define EXAMPLE_H
+#include <stdbool.h>
+#include <stddef.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
+// Threads shared by every request for the parallel parts of the processing,
+// 0 uses one per core. Call before the first request, the default is 0.
+void setWorkerThreads(int threads);
+// Threads a parallel part of one request runs on, the calling one included
+int workerThreads(void);
+
 bool scaleImage(const char* imagePath, const char* newImagePath, int newWidth, int newHeight);
 bool quantizeImage(const char* imagePath, const char* newImagePath, int N);
+
+// zlib level, row filters and deflate strategy of the PNG encoder. Palette
+// outputs always skip the row filters, they rarely help on indices.
+typedef enum PngEncodeProfile {
+  PNG_ENCODE_BALANCED = 0, // libpng defaults
+  PNG_ENCODE_FAST,         // level 1, one cheap filter, run-length matching
+  PNG_ENCODE_SMALLEST      // level 9, every filter tried on every row
+} PngEncodeProfile;
+
+// How scaling computes an output pixel from the source pixels under it
+typedef enum ScaleFilter {
+  SCALE_FILTER_BOX = 0,   // mean of the block, streams large images, fastest
+  SCALE_FILTER_AREA,      // mean weighted by how much of each pixel is covered
+  SCALE_FILTER_BILINEAR,
+  SCALE_FILTER_BICUBIC,
+  SCALE_FILTER_LANCZOS3   // sharpest, best for photos
+} ScaleFilter;
+
+typedef struct ScaleOptions {
+  PngEncodeProfile encodeProfile;
+  ScaleFilter filter;
+} ScaleOptions;
+
+typedef struct ScaleReport {
+  PngEncodeProfile encodeProfile;
+  long long encodeMicros; // time spent in the PNG encoder
+} ScaleReport;
+
+// Scaled images keep the channels of the source, gray stays gray and palettes
+// become RGB, with alpha added when the picture is padded to the new aspect.
+// options and report may be NULL
+bool scaleImageWithOptions(const char* imagePath, const char* newImagePath,
+                           int newWidth, int newHeight,
+                           const ScaleOptions* options, ScaleReport* report);
+
+// One output of scaleImageLadder
+typedef struct ScaleTarget {
+  const char* imagePath;
+  int width;
+  int height;
+} ScaleTarget;
+
+// scaleImageWithOptions for every target, from a single decode of imagePath.
+// Smaller sizes are cut from larger ones eight times their width and height.
+// reports may be NULL, otherwise it holds count reports in target order
+bool scaleImageLadder(const char* imagePath, const ScaleTarget* targets, int count,
+                      const ScaleOptions* options, ScaleReport* reports);
+
+// Deflate library behind the PNG codec, "zlib" or "libdeflate"
+const char* pngDeflateBackend(void);
+
+typedef struct TranscodeReport {
+  int width;
+  int height;
+  long long decodeMicros; // time spent in the PNG decoder
+  long long encodeMicros; // time spent in the PNG encoder
+} TranscodeReport;
+
+// Decodes imagePath to RGBA and encodes it unchanged to newImagePath, for
+// measuring the PNG codec. report may be NULL
+bool transcodeImage(const char* imagePath, const char* newImagePath,
+                    PngEncodeProfile encodeProfile, TranscodeReport* report);
+
+// How k-means finds the nearest center of every color, all give the same result
+typedef enum KmeansAssignment {
+  KMEANS_ASSIGN_AUTO = 0,    // picked from the palette size
+  KMEANS_ASSIGN_BRUTE_FORCE, // distance to every center
+  KMEANS_ASSIGN_HAMERLY,     // one lower bound per color, best for small palettes
+  KMEANS_ASSIGN_ELKAN        // one lower bound per color and center, large palettes
+} KmeansAssignment;
+
+// How quantizeImage picks the palette
+typedef enum QuantizeMethod {
+  QUANTIZE_KMEANS = 0,   // k-means++ seeding then k-means, best colors, slowest
+  QUANTIZE_MEDIAN_CUT,   // single pass methods with predictable latency,
+  QUANTIZE_OCTREE,       // optionally refined by a few k-means iterations
+  QUANTIZE_WU
+} QuantizeMethod;
+
+// Tuning for quantizeImageWithOptions, zeroed fields keep the defaults
+typedef struct QuantizeOptions {
+  int maxIterations; // k-means iterations, 50 when 0
+  int timeBudgetMs;  // return the current centers after this long, 0 is no limit
+  KmeansAssignment assignment;
+  unsigned int seed; // k-means++ seed, the same seed gives the same output
+  QuantizeMethod method;
+  int refineIterations; // k-means iterations after the other methods, 0 is none
+  PngEncodeProfile encodeProfile;
+} QuantizeOptions;
+
+typedef struct QuantizeReport {
+  int iterations; // k-means iterations actually run
+  bool converged; // centers stopped moving before the limits were hit
+  KmeansAssignment assignment; // the one k-means ran with, never AUTO
+  PngEncodeProfile encodeProfile;
+  long long encodeMicros; // time spent in the PNG encoder
+} QuantizeReport;
+
+// options and report may be NULL
+bool quantizeImageWithOptions(const char* imagePath, const char* newImagePath, int N,
+                              const QuantizeOptions* options, QuantizeReport* report);
+
+// scaleImageWithOptions followed by quantizeImageWithOptions on its output,
+// with the source decoded once and the quantizer working on the scaled pixels
+// in memory instead of reading scaledImagePath back. Options and reports may
+// be NULL
+bool scaleQuantizeImage(const char* imagePath, const char* scaledImagePath,
+                        const char* quantizedImagePath, int newWidth, int newHeight,
+                        int N, const ScaleOptions* scaleOptions,
+                        const QuantizeOptions* quantizeOptions,
+                        ScaleReport* scaleReport, QuantizeReport* quantizeReport);
+
+// Bytes passed in and out of the buffer calls below. Leave data NULL and the
+// library allocates it, release that with freeImageBuffer. Or point data at
+// capacity bytes of your own, the call then fails when they are too few and
+// size holds the bytes it needed.
+typedef struct ImageBuffer {
+  unsigned char* data;
+  size_t size;     // bytes written
+  size_t capacity; // bytes available at data
+} ImageBuffer;
+
+// Frees data the library allocated and empties the buffer
+void freeImageBuffer(ImageBuffer* buffer);
+
+// The calls above on PNG bytes in memory, writing the PNG to output instead
+// of a file. options and report may be NULL
+bool scaleImageBuffer(const unsigned char* png, size_t pngSize, int newWidth,
+                      int newHeight, const ScaleOptions* options,
+                      ImageBuffer* output, ScaleReport* report);
+bool quantizeImageBuffer(const unsigned char* png, size_t pngSize, int N,
+                         const QuantizeOptions* options, ImageBuffer* output,
+                         QuantizeReport* report);
+// Free both outputs whatever the result, the scaled one may be written when
+// quantizing fails
+bool scaleQuantizeImageBuffer(const unsigned char* png, size_t pngSize,
+                              int newWidth, int newHeight, int N,
+                              const ScaleOptions* scaleOptions,
+                              const QuantizeOptions* quantizeOptions,
+                              ImageBuffer* scaledOutput, ImageBuffer* quantizedOutput,
+                              ScaleReport* scaleReport, QuantizeReport* quantizeReport);
+// outputs holds count buffers in target order, the imagePath of the targets
+// is not used. Free every output whatever the result.
+bool scaleImageLadderBuffer(const unsigned char* png, size_t pngSize,
+                            const ScaleTarget* targets, int count,
+                            const ScaleOptions* options, ImageBuffer* outputs,
+                            ScaleReport* reports);
+
+// Decodes PNG bytes to RGBA pixels, rows packed without padding
+bool decodeImageBuffer(const unsigned char* png, size_t pngSize,
+                       ImageBuffer* rgba, int* width, int* height);
 #ifdef __cplusplus
 }
 #endif
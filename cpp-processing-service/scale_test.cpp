@@ -0,0 +1,131 @@
+// Checks how scaling writes its output file: in place over its own source,
+// and not at all when the source turns out to be truncated. Runs the
+// streamed box resize and the whole-image Lanczos one. Exits non-zero on the
+// first failed check.
+#include "processing.h"
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <png.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+int failures = 0;
+
+void check(bool ok, const std::string &name) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", name.c_str());
+  if (!ok) {
+    ++failures;
+  }
+}
+
+// A noisy RGBA PNG in memory
+std::vector<unsigned char> noisePng(int width, int height) {
+  std::vector<png_byte> pixels(static_cast<size_t>(width) * height * 4);
+  unsigned state = 1;
+  for (auto &byte : pixels) {
+    state = state * 1103515245 + 12345;
+    byte = state >> 24;
+  }
+  png_image image = {};
+  image.version = PNG_IMAGE_VERSION;
+  image.width = width;
+  image.height = height;
+  image.format = PNG_FORMAT_RGBA;
+  png_alloc_size_t size = 0;
+  png_image_write_to_memory(&image, NULL, &size, 0, pixels.data(), 0, NULL);
+  std::vector<unsigned char> png(size);
+  png_image_write_to_memory(&image, png.data(), &size, 0, pixels.data(), 0, NULL);
+  png.resize(size);
+  return png;
+}
+
+void writeFile(const std::string &path, const std::vector<unsigned char> &bytes) {
+  FILE *file = fopen(path.c_str(), "wb");
+  if (!file || fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size() ||
+      fclose(file) != 0) {
+    fprintf(stderr, "Error: could not write %s\n", path.c_str());
+    exit(1);
+  }
+}
+
+std::vector<unsigned char> readFile(const std::string &path) {
+  std::vector<unsigned char> bytes;
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return bytes;
+  }
+  unsigned char chunk[1 << 16];
+  size_t count;
+  while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    bytes.insert(bytes.end(), chunk, chunk + count);
+  }
+  fclose(file);
+  return bytes;
+}
+
+// Files in directory, . and .. aside
+int fileCount(const std::string &directory) {
+  int count = 0;
+  DIR *entries = opendir(directory.c_str());
+  while (entries && readdir(entries)) {
+    ++count;
+  }
+  if (entries) {
+    closedir(entries);
+  }
+  return count - 2;
+}
+
+void scaleFiles(const std::string &directory, ScaleFilter filter,
+                const char *name) {
+  ScaleOptions options = {};
+  options.filter = filter;
+  std::vector<unsigned char> png = noisePng(300, 200);
+
+  // Over its own source: the output is the whole scaled image
+  std::string path = directory + "/same.png";
+  writeFile(path, png);
+  bool scaled = scaleImageWithOptions(path.c_str(), path.c_str(), 150, 100,
+                                      &options, NULL);
+  std::vector<unsigned char> output = readFile(path);
+  ImageBuffer rgba = {};
+  int width = 0;
+  int height = 0;
+  bool decoded =
+      decodeImageBuffer(output.data(), output.size(), &rgba, &width, &height);
+  freeImageBuffer(&rgba);
+  check(scaled && decoded && width == 150 && height == 100,
+        std::string(name) + ": scales a file onto itself");
+
+  // From a truncated source: fails and leaves the old destination alone
+  std::string truncated = directory + "/truncated.png";
+  std::string destination = directory + "/destination.png";
+  writeFile(truncated, std::vector<unsigned char>(png.begin(),
+                                                  png.begin() + png.size() / 2));
+  writeFile(destination, png);
+  scaled = scaleImageWithOptions(truncated.c_str(), destination.c_str(), 150,
+                                 100, &options, NULL);
+  check(!scaled, std::string(name) + ": truncated source fails");
+  check(readFile(destination) == png,
+        std::string(name) + ": failure keeps the old destination");
+  check(fileCount(directory) == 3,
+        std::string(name) + ": failure leaves no temporary file");
+
+  unlink(path.c_str());
+  unlink(truncated.c_str());
+  unlink(destination.c_str());
+}
+
+int main() {
+  char directory[] = "/tmp/scale_test.XXXXXX";
+  if (!mkdtemp(directory)) {
+    fprintf(stderr, "Error: could not create a directory\n");
+    return 1;
+  }
+  scaleFiles(directory, SCALE_FILTER_BOX, "box");
+  scaleFiles(directory, SCALE_FILTER_LANCZOS3, "lanczos");
+  rmdir(directory);
+  return failures == 0 ? 0 : 1;
+}
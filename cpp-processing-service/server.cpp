@@ -1,45 +1,429 @@
 #define DEBUG 1
 #include "processing.h"
 #include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <thread>
 #include <unistd.h>
+#include <unordered_map>
 #include <variant>
+#include <vector>
 
 struct ScaleTask {
   std::string imagePath;
   std::string resizedImagePath;
   int newWidth;
   int newHeight;
+  ScaleOptions options;
 };
 
 struct QuantizeTask {
   std::string imagePath;
   std::string quantizedImagePath;
   int levels;
+  QuantizeOptions options;
 };
 
+struct ScaleQuantizeTask {
+  std::string imagePath;
+  std::string resizedImagePath;
+  std::string quantizedImagePath;
+  int newWidth;
+  int newHeight;
+  int levels;
+  ScaleOptions scaleOptions;
+  QuantizeOptions quantizeOptions;
+};
+
+struct ScaleLadderTask {
+  std::string imagePath;
+  std::vector<std::string> resizedImagePaths;
+  std::vector<std::pair<int, int>> sizes;
+  ScaleOptions options;
+};
+
+// Asks for the load of the task workers, answered without queueing
+struct StatusTask {};
+
 using Error = std::string;
-using TaskOrError = std::variant<ScaleTask, QuantizeTask, Error>;
+using TaskOrError = std::variant<ScaleTask, QuantizeTask, ScaleQuantizeTask,
+                                 ScaleLadderTask, StatusTask, Error>;
+using TaskOptions = std::map<std::string, std::string>;
+
+// An image file written by a task run with TaskFiles
+struct TaskOutput {
+  std::string path;
+  int fd = -1;
+  ImageBuffer buffer = {}; // the PNG, filled in by the worker
+  size_t written = 0;
+};
+
+// The files of a task run by the io_uring backend. The ring reads the input
+// and writes the outputs, the worker only runs the buffer calls in between.
+struct TaskFiles {
+  ~TaskFiles();
+
+  uint64_t id;
+  uint64_t connection;
+  TaskOrError task;
+  std::string inputPath;
+  int inputFd = -1;
+  std::vector<unsigned char> input; // bytes read so far
+  size_t inputSize = 0;
+  std::vector<TaskOutput> outputs;
+  size_t pendingOutputs = 0;
+  std::string reply;
+  bool failed = false;
+  bool submitted = false; // handed to the workers
+};
+
+// A task read from a client, on its way to the task workers. files is only
+// set by the io_uring backend, for the tasks whose files it reads and writes.
+struct Job {
+  uint64_t connection;
+  TaskOrError task;
+  TaskFiles *files;
+};
+
+// The reply to a Job, on its way back to the reactor
+struct Completion {
+  uint64_t connection;
+  std::string reply;
+  TaskFiles *files;
+};
+
+// A client socket owned by a reactor. Clients send a task and wait for its
+// reply, the bytes that arrive in one burst are one task the way a single
+// recv used to be.
+struct Connection {
+  int socket;
+  std::string input;            // received bytes not yet parsed
+  std::string output;           // reply bytes not yet sent
+  bool busy = false;            // a task is with the workers
+  bool peerClosed = false;      // no more tasks, close once the last is answered
+  bool closeAfterReply = false; // error replies end the connection
+  bool receiving = false;       // io_uring only, a multishot recv is armed
+  bool sending = false;         // io_uring only, output is being sent
+  bool closing = false;         // io_uring only, waiting for the above to end
+};
+
+// Size of the task worker pool and the backlog it accepts, see TaskWorkers
+struct WorkerLimits {
+  size_t threads;
+  size_t highWatermark; // waiting tasks at which new ones are refused
+  size_t lowWatermark;  // waiting tasks at which they are admitted again
+};
 
+// Fixed set of threads running processTask on the jobs the reactor submits.
+// Replies are collected in completions and signalled by a write to wakeup,
+// an eventfd the reactor polls. The reactor admits every task before it
+// does any work for it, once highWatermark tasks wait for a thread the rest
+// are refused until the backlog is down to lowWatermark. admit, release,
+// takeCompletions and the replies are for the reactor thread only.
+class TaskWorkers {
+public:
+  TaskWorkers(const WorkerLimits &limits, int wakeup);
+  ~TaskWorkers();
+  bool admit();
+  void release();
+  void submit(Job job);
+  std::vector<Completion> takeCompletions();
+  std::string busyReply() const;
+  std::string statusReply() const;
+
+private:
+  void run();
+  size_t backlog() const;
+
+  WorkerLimits limits;
+  int wakeup;
+  size_t admitted = 0; // tasks admitted and not yet taken back
+  bool shedding = false;
+  std::atomic<size_t> running{0}; // picked up by a thread, not yet taken back
+  std::atomic<long long> averageMicros{0}; // recent time per task
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<Job> jobs;
+  std::vector<Completion> completions;
+  bool stopping = false;
+  std::vector<std::thread> threads;
+};
+
+// Edge triggered epoll loop on one thread, owning the listening socket and
+// every client socket, all non-blocking. Only the task workers block.
+class EpollReactor {
+public:
+  EpollReactor(int serverSocket, int epoll, int wakeup, const WorkerLimits &limits);
+  void run();
+
+private:
+  void acceptConnections();
+  void readConnection(uint64_t id);
+  void writeConnection(uint64_t id);
+  void dispatch(uint64_t id, Connection &connection);
+  void deliverCompletions();
+  void closeConnection(uint64_t id);
+
+  int serverSocket;
+  int epoll;
+  int wakeup;
+  uint64_t nextConnection;
+  std::unordered_map<uint64_t, Connection> connections;
+  TaskWorkers workers;
+};
+
+// io_uring through the raw system calls, liburing is not a dependency. Only
+// the reactor thread touches it.
+class IoUring {
+public:
+  ~IoUring();
+  bool open(unsigned entries, unsigned completions);
+  io_uring_sqe *prepare(int opcode, int fd, uint64_t userData);
+  int submit(bool wait);
+  unsigned takeCompletions(io_uring_cqe *out, unsigned max);
+  bool registerBuffers(unsigned short group, unsigned count, unsigned size);
+  const char *buffer(unsigned short id) const;
+  void returnBuffer(unsigned short id);
+
+private:
+  int fd = -1;
+  void *rings = MAP_FAILED;
+  size_t ringsSize = 0;
+  io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+  size_t sqesSize = 0;
+  unsigned *sqTail;
+  unsigned *sqHead;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned *sqArray;
+  unsigned sqPending = 0;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  io_uring_cqe *cqes;
+  io_uring_buf_ring *bufferRing = static_cast<io_uring_buf_ring *>(MAP_FAILED);
+  io_uring_buf *bufferEntries;
+  size_t bufferRingSize = 0;
+  unsigned bufferCount = 0;
+  unsigned bufferSize = 0;
+  std::vector<char> bufferMemory;
+};
+
+// The event loop on an io_uring instead of epoll. Clients are accepted and
+// read with multishot requests into a registered buffer ring, replies sent
+// through the ring, and the image files of quantize and ladder tasks opened,
+// read and written by it too. Their task workers get the input bytes and
+// hand back the output bytes, they never wait on the storage behind the
+// files. Scale and scale then quantize tasks are left out: their workers
+// read and write the files with blocking calls, as under epoll, because the
+// streaming resize holds a few rows of a large source where the ring would
+// have to read all of it. The Go frontend only sends those, so with it a
+// worker still blocks on storage for every task.
+class UringReactor {
+public:
+  UringReactor(int serverSocket, IoUring &ring, int wakeup, const WorkerLimits &limits);
+  void run();
+
+private:
+  void handle(const io_uring_cqe &completion);
+  void armAccept();
+  void armReceive(uint64_t id, Connection &connection);
+  void armWakeup();
+  void accepted(int clientSocket);
+  void received(uint64_t id, const io_uring_cqe &completion);
+  void sent(uint64_t id, int result);
+  void writeConnection(uint64_t id);
+  void dispatch(uint64_t id, Connection &connection);
+  void deliverCompletions();
+  void closeConnection(uint64_t id);
+  void openInput(TaskFiles &files);
+  void readInput(TaskFiles &files);
+  void inputOpened(TaskFiles &files, int result);
+  void inputRead(TaskFiles &files, int result);
+  void openOutput(TaskFiles &files, size_t index);
+  void writeOutput(TaskFiles &files, size_t index);
+  void outputOpened(TaskFiles &files, size_t index, int result);
+  void outputWritten(TaskFiles &files, size_t index, int result);
+  void outputClosed(TaskFiles &files, int result);
+  void finishTask(TaskFiles &files);
+  void answer(uint64_t id, std::string reply);
+
+  int serverSocket;
+  IoUring &ring;
+  int wakeup;
+  uint64_t wakeupCount = 0;
+  uint64_t nextConnection;
+  uint64_t nextTask = 1;
+  std::unordered_map<uint64_t, Connection> connections;
+  std::unordered_map<uint64_t, std::unique_ptr<TaskFiles>> tasks;
+  TaskWorkers workers;
+};
+
+std::variant<TaskOptions, Error> parseTaskOptions(const std::string &buffer,
+                                                  size_t start);
+bool parseEncodeProfile(const std::string &value, PngEncodeProfile &profile);
+const char *encodeProfileName(PngEncodeProfile profile);
+bool parseScaleFilter(const std::string &value, ScaleFilter &filter);
+std::variant<QuantizeOptions, Error> parseQuantizeOptions(const TaskOptions &options);
 TaskOrError parseTask(const std::string &buffer);
 int openSocket(int port);
+int openEventLoop(int serverSocket, int wakeup);
 int acceptConnection(int serverSocket);
-TaskOrError receiveTask(int clientSocket);
-bool processTask(TaskOrError task);
-bool sendResult(int clientSocket, std::string result);
-void handleClient(int clientSocket);
+TaskOrError receiveTask(const std::string &buffer);
+bool takeTask(Connection &connection, TaskWorkers &workers, TaskOrError &task);
+std::unique_ptr<TaskFiles> taskFiles(const TaskOrError &task);
+std::string processTask(TaskOrError task, TaskFiles *files);
+WorkerLimits workerLimits();
+bool useUring();
+
 
 
 
 
+// Optional task fields come after the required ones as <key>=<value>:
+std::variant<TaskOptions, Error> parseTaskOptions(const std::string &buffer,
+                                                  size_t start) {
+  TaskOptions options;
+  while (start < buffer.size()) {
+    auto end = buffer.find(':', start);
+    if (end == std::string::npos) {
+      end = buffer.size();
+    }
+    auto field = buffer.substr(start, end - start);
+    start = end + 1;
+    if (field.empty() || field == "\n") {
+      continue;
+    }
+
+    auto equals = field.find('=');
+    if (equals == std::string::npos || equals == 0) {
+      return Error("Invalid task: malformed option " + field);
+    }
+    options[field.substr(0, equals)] = field.substr(equals + 1);
+  }
+  return options;
+}
+
+// "encode=<fast|balanced|smallest>:" option of any task writing a PNG
+bool parseEncodeProfile(const std::string &value, PngEncodeProfile &profile) {
+  if (value == "fast") {
+    profile = PNG_ENCODE_FAST;
+  } else if (value == "balanced") {
+    profile = PNG_ENCODE_BALANCED;
+  } else if (value == "smallest") {
+    profile = PNG_ENCODE_SMALLEST;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// "filter=<box|area|bilinear|bicubic|lanczos3>:" option of any task scaling
+bool parseScaleFilter(const std::string &value, ScaleFilter &filter) {
+  if (value == "box") {
+    filter = SCALE_FILTER_BOX;
+  } else if (value == "area") {
+    filter = SCALE_FILTER_AREA;
+  } else if (value == "bilinear") {
+    filter = SCALE_FILTER_BILINEAR;
+  } else if (value == "bicubic") {
+    filter = SCALE_FILTER_BICUBIC;
+  } else if (value == "lanczos3") {
+    filter = SCALE_FILTER_LANCZOS3;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *encodeProfileName(PngEncodeProfile profile) {
+  switch (profile) {
+  case PNG_ENCODE_FAST:
+    return "fast";
+  case PNG_ENCODE_SMALLEST:
+    return "smallest";
+  default:
+    return "balanced";
+  }
+}
+
+// Options of the tasks that quantize, see parseTask
+std::variant<QuantizeOptions, Error> parseQuantizeOptions(const TaskOptions &options) {
+  QuantizeOptions quantizeOptions = {};
+  for (const auto &[key, value] : options) {
+    if (key == "iterations") {
+      quantizeOptions.maxIterations = std::stoi(value);
+    } else if (key == "budget") {
+      quantizeOptions.timeBudgetMs = std::stoi(value);
+    } else if (key == "encode") {
+      if (!parseEncodeProfile(value, quantizeOptions.encodeProfile)) {
+        return Error("Invalid task: unknown encode profile " + value);
+      }
+    } else if (key == "refine") {
+      quantizeOptions.refineIterations = std::stoi(value);
+    } else if (key == "method") {
+      if (value == "kmeans") {
+        quantizeOptions.method = QUANTIZE_KMEANS;
+      } else if (value == "mediancut") {
+        quantizeOptions.method = QUANTIZE_MEDIAN_CUT;
+      } else if (value == "octree") {
+        quantizeOptions.method = QUANTIZE_OCTREE;
+      } else if (value == "wu") {
+        quantizeOptions.method = QUANTIZE_WU;
+      } else {
+        return Error("Invalid task: unknown quantize method " + value);
+      }
+    } else if (key == "seed") {
+      quantizeOptions.seed = std::stoul(value);
+    } else if (key == "assign") {
+      if (value == "auto") {
+        quantizeOptions.assignment = KMEANS_ASSIGN_AUTO;
+      } else if (value == "brute") {
+        quantizeOptions.assignment = KMEANS_ASSIGN_BRUTE_FORCE;
+      } else if (value == "hamerly") {
+        quantizeOptions.assignment = KMEANS_ASSIGN_HAMERLY;
+      } else if (value == "elkan") {
+        quantizeOptions.assignment = KMEANS_ASSIGN_ELKAN;
+      } else {
+        return Error("Invalid task: unknown assignment " + value);
+      }
+    } else {
+      return Error("Invalid task: unknown quantize option " + key);
+    }
+  }
+  return quantizeOptions;
+}
 
 // The task package is a string of the form:
 //<task_type>:<task_data>:
-// where task_type is either 's' for scale or 'q' for quantize
+// where task_type is either 's' for scale, 'q' for quantize, 'f' for a scale
+// followed by a quantize of its output or 'l' for a ladder of scales. "h:"
+// alone asks for the load of the server.
 TaskOrError parseTask(const std::string &buffer) {
 
+  if (buffer.compare(0, 2, "h:") == 0) {
+    return StatusTask{};
+  }
+
   if (buffer.size() < 3) {
     return Error("Invalid task: too short");
   }
@@ -49,6 +433,9 @@ TaskOrError parseTask(const std::string &buffer) {
   }
 
   if (buffer[0] == 's') {
+    // scale task example: "s:/path/to/image:/path/to/scaled/image:64:64:"
+    // optionally followed by "encode=<fast|balanced|smallest>:" and
+    // "filter=<box|area|bilinear|bicubic|lanczos3>:"
     auto colonPos = buffer.find(':', 2);
     if (colonPos == std::string::npos) {
       return Error("Invalid task: missing colon on position 2 for scale task");
@@ -69,11 +456,42 @@ TaskOrError parseTask(const std::string &buffer) {
         buffer.substr(colonPos + 1, colonPos2 - colonPos - 1);
     auto newWidth =
         std::stoi(buffer.substr(colonPos2 + 1, colonPos3 - colonPos2 - 1));
-    auto newHeight = std::stoi(buffer.substr(colonPos3 + 1));
+    auto heightEnd = buffer.find(':', colonPos3 + 1);
+    auto newHeight = std::stoi(buffer.substr(colonPos3 + 1, heightEnd - colonPos3 - 1));
+    if (newWidth <= 0 || newHeight <= 0) {
+      return Error("Invalid task: size must be positive for scale task");
+    }
 
-    return ScaleTask{imagePath, resizedImagePath, newWidth, newHeight};
+    ScaleOptions scaleOptions = {};
+    if (heightEnd != std::string::npos) {
+      auto options = parseTaskOptions(buffer, heightEnd + 1);
+      if (std::holds_alternative<Error>(options)) {
+        return std::get<Error>(options);
+      }
+      for (const auto &[key, value] : std::get<TaskOptions>(options)) {
+        if (key == "encode") {
+          if (!parseEncodeProfile(value, scaleOptions.encodeProfile)) {
+            return Error("Invalid task: unknown encode profile " + value);
+          }
+        } else if (key == "filter") {
+          if (!parseScaleFilter(value, scaleOptions.filter)) {
+            return Error("Invalid task: unknown scale filter " + value);
+          }
+        } else {
+          return Error("Invalid task: unknown scale option " + key);
+        }
+      }
+    }
+
+    return ScaleTask{imagePath, resizedImagePath, newWidth, newHeight, scaleOptions};
   } else if (buffer[0] == 'q') {
       //quantize task example: "q:/path/to/image:/path/to/quantized/image:256:"
+      // optionally followed by "iterations=<max k-means iterations>:",
+      // "budget=<k-means time budget in ms>:",
+      // "assign=<auto|brute|hamerly|elkan>:", "seed=<k-means++ seed>:",
+      // "method=<kmeans|mediancut|octree|wu>:",
+      // "refine=<k-means iterations after the other methods>:" and
+      // "encode=<fast|balanced|smallest>:"
     auto imagePathEnd = buffer.find(':', 2);
     if (imagePathEnd == std::string::npos) {
       return Error("Invalid task: missing colon on position 2 for quantize task");
@@ -93,15 +511,166 @@ TaskOrError parseTask(const std::string &buffer) {
     auto quantizedImagePath =
         buffer.substr(imagePathEnd + 1, quantizedImagePathEnd - imagePathEnd - 1);
     auto levels = std::stoi(buffer.substr(quantizedImagePathEnd + 1, levelsEnd - quantizedImagePathEnd - 1));
+    if (levels <= 0) {
+      return Error("Invalid task: levels must be positive for quantize task");
+    }
+
+    auto options = parseTaskOptions(buffer, levelsEnd + 1);
+    if (std::holds_alternative<Error>(options)) {
+      return std::get<Error>(options);
+    }
+
+    auto quantizeOptions = parseQuantizeOptions(std::get<TaskOptions>(options));
+    if (std::holds_alternative<Error>(quantizeOptions)) {
+      return std::get<Error>(quantizeOptions);
+    }
+
+    return QuantizeTask{imagePath, quantizedImagePath, levels,
+                        std::get<QuantizeOptions>(quantizeOptions)};
+  } else if (buffer[0] == 'f') {
+    // scale and quantize task example:
+    // "f:/path/to/image:/path/to/scaled/image:/path/to/quantized/image:64:64:8:"
+    // optionally followed by the quantize task options and "filter=" of the
+    // scale task, "encode=" applies to both outputs
+    auto imagePathEnd = buffer.find(':', 2);
+    if (imagePathEnd == std::string::npos) {
+      return Error("Invalid task: missing colon on position 2 for scale and quantize task");
+    }
+
+    auto resizedImagePathEnd = buffer.find(':', imagePathEnd + 1);
+    if (resizedImagePathEnd == std::string::npos) {
+      return Error("Invalid task: missing colon on position 3 for scale and quantize task");
+    }
+
+    auto quantizedImagePathEnd = buffer.find(':', resizedImagePathEnd + 1);
+    if (quantizedImagePathEnd == std::string::npos) {
+      return Error("Invalid task: missing colon on position 4 for scale and quantize task");
+    }
+
+    auto widthEnd = buffer.find(':', quantizedImagePathEnd + 1);
+    if (widthEnd == std::string::npos) {
+      return Error("Invalid task: missing colon on position 5 for scale and quantize task");
+    }
+
+    auto heightEnd = buffer.find(':', widthEnd + 1);
+    if (heightEnd == std::string::npos) {
+      return Error("Invalid task: missing colon on position 6 for scale and quantize task");
+    }
+
+    auto levelsEnd = buffer.find(':', heightEnd + 1);
+    if (levelsEnd == std::string::npos) {
+      return Error("Invalid task: missing colon on position 7 for scale and quantize task");
+    }
+
+    auto imagePath = buffer.substr(2, imagePathEnd - 2);
+    auto resizedImagePath =
+        buffer.substr(imagePathEnd + 1, resizedImagePathEnd - imagePathEnd - 1);
+    auto quantizedImagePath = buffer.substr(
+        resizedImagePathEnd + 1, quantizedImagePathEnd - resizedImagePathEnd - 1);
+    auto newWidth = std::stoi(
+        buffer.substr(quantizedImagePathEnd + 1, widthEnd - quantizedImagePathEnd - 1));
+    auto newHeight = std::stoi(buffer.substr(widthEnd + 1, heightEnd - widthEnd - 1));
+    auto levels = std::stoi(buffer.substr(heightEnd + 1, levelsEnd - heightEnd - 1));
+    if (newWidth <= 0 || newHeight <= 0 || levels <= 0) {
+      return Error("Invalid task: size and levels must be positive for scale and quantize task");
+    }
+
+    auto options = parseTaskOptions(buffer, levelsEnd + 1);
+    if (std::holds_alternative<Error>(options)) {
+      return std::get<Error>(options);
+    }
+
+    ScaleOptions scaleOptions = {};
+    auto &taskOptions = std::get<TaskOptions>(options);
+    auto filter = taskOptions.find("filter");
+    if (filter != taskOptions.end()) {
+      if (!parseScaleFilter(filter->second, scaleOptions.filter)) {
+        return Error("Invalid task: unknown scale filter " + filter->second);
+      }
+      taskOptions.erase(filter);
+    }
+
+    auto quantizeOptions = parseQuantizeOptions(taskOptions);
+    if (std::holds_alternative<Error>(quantizeOptions)) {
+      return std::get<Error>(quantizeOptions);
+    }
+    scaleOptions.encodeProfile =
+        std::get<QuantizeOptions>(quantizeOptions).encodeProfile;
 
-    return QuantizeTask{imagePath, quantizedImagePath, levels};
+    return ScaleQuantizeTask{imagePath, resizedImagePath, quantizedImagePath,
+                             newWidth,  newHeight,        levels,
+                             scaleOptions, std::get<QuantizeOptions>(quantizeOptions)};
+  } else if (buffer[0] == 'l') {
+    // scale ladder task example: "l:/path/to/image:/path/to/scaled:64x64,128x128:"
+    // writes /path/to/scaled-64x64.png and /path/to/scaled-128x128.png,
+    // optionally followed by the scale task options
+    auto imagePathEnd = buffer.find(':', 2);
+    if (imagePathEnd == std::string::npos) {
+      return Error("Invalid task: missing colon on position 2 for scale ladder task");
+    }
+
+    auto prefixEnd = buffer.find(':', imagePathEnd + 1);
+    if (prefixEnd == std::string::npos) {
+      return Error("Invalid task: missing colon on position 3 for scale ladder task");
+    }
+
+    auto sizesEnd = buffer.find(':', prefixEnd + 1);
+    if (sizesEnd == std::string::npos) {
+      return Error("Invalid task: missing colon on position 4 for scale ladder task");
+    }
+
+    ScaleLadderTask task;
+    task.imagePath = buffer.substr(2, imagePathEnd - 2);
+    auto prefix = buffer.substr(imagePathEnd + 1, prefixEnd - imagePathEnd - 1);
+    for (size_t start = prefixEnd + 1; start < sizesEnd;) {
+      auto end = std::min(buffer.find(',', start), sizesEnd);
+      auto size = buffer.substr(start, end - start);
+      start = end + 1;
+
+      auto x = size.find('x');
+      if (x == std::string::npos) {
+        return Error("Invalid task: malformed size " + size);
+      }
+      auto width = std::stoi(size.substr(0, x));
+      auto height = std::stoi(size.substr(x + 1));
+      if (width <= 0 || height <= 0) {
+        return Error("Invalid task: size must be positive " + size);
+      }
+      task.sizes.emplace_back(width, height);
+      task.resizedImagePaths.push_back(prefix + "-" + std::to_string(width) + "x" +
+                                       std::to_string(height) + ".png");
+    }
+    if (task.sizes.empty()) {
+      return Error("Invalid task: no sizes for scale ladder task");
+    }
+
+    auto options = parseTaskOptions(buffer, sizesEnd + 1);
+    if (std::holds_alternative<Error>(options)) {
+      return std::get<Error>(options);
+    }
+    task.options = {};
+    for (const auto &[key, value] : std::get<TaskOptions>(options)) {
+      if (key == "encode") {
+        if (!parseEncodeProfile(value, task.options.encodeProfile)) {
+          return Error("Invalid task: unknown encode profile " + value);
+        }
+      } else if (key == "filter") {
+        if (!parseScaleFilter(value, task.options.filter)) {
+          return Error("Invalid task: unknown scale filter " + value);
+        }
+      } else {
+        return Error("Invalid task: unknown scale option " + key);
+      }
+    }
+
+    return task;
   } else {
     return Error("Invalid task");
   }
 }
 
 int openSocket(int port) {
-  int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+  int serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (serverSocket < 0) {
     return -1;
   }
@@ -116,94 +685,1225 @@ int openSocket(int port) {
     return -1;
   }
 
-  if (listen(serverSocket, 10) < 0) {
+  // Overload is answered with busy replies, not left to a full backlog
+  if (listen(serverSocket, SOMAXCONN) < 0) {
     return -1;
   }
 
   return serverSocket;
 }
 
+// Ids of the epoll entries that are not connections, see EpollReactor::run
+constexpr uint64_t listenerId = 0;
+constexpr uint64_t wakeupId = 1;
+
+// epoll instance watching the listening socket and the workers' wakeup
+int openEventLoop(int serverSocket, int wakeup) {
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll < 0) {
+    return -1;
+  }
+
+  struct epoll_event event = {};
+  event.events = EPOLLIN | EPOLLET;
+  event.data.u64 = listenerId;
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, serverSocket, &event) < 0) {
+    close(epoll);
+    return -1;
+  }
+  event.data.u64 = wakeupId;
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, wakeup, &event) < 0) {
+    close(epoll);
+    return -1;
+  }
+  return epoll;
+}
+
 int acceptConnection(int serverSocket) {
   struct sockaddr_in clientAddress;
   socklen_t clientAddressLength = sizeof(clientAddress);
-  return accept(serverSocket, (struct sockaddr *)&clientAddress,
-                &clientAddressLength);
+  return accept4(serverSocket, (struct sockaddr *)&clientAddress,
+                 &clientAddressLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
 }
 
-TaskOrError receiveTask(int clientSocket) {
-  char buffer[2048];
-  int bytesRead = recv(clientSocket, buffer, 2048, 0);
-  if (bytesRead < 0) {
-    return Error("Failed to receive task");
+TaskOrError receiveTask(const std::string &buffer) {
+  try {
+    return parseTask(buffer);
+  } catch (const std::logic_error &) {
+    // std::stoi on a field that is not a number
+    return Error("Invalid task: malformed number");
   }
-  if (bytesRead == 0) {
-    return Error("Client disconnected");
+}
+
+// Parses the task received on connection into task. Returns false when no
+// worker is needed: invalid tasks, status requests and tasks refused under
+// load have their reply queued on the connection instead.
+bool takeTask(Connection &connection, TaskWorkers &workers, TaskOrError &task) {
+  task = receiveTask(connection.input);
+  connection.input.clear();
+
+  if (std::holds_alternative<Error>(task)) {
+    printf("%s\n", std::get<Error>(task).c_str());
+    connection.output = std::get<Error>(task);
+    connection.closeAfterReply = true;
+    return false;
+  }
+  if (std::holds_alternative<StatusTask>(task)) {
+    connection.output = workers.statusReply();
+    return false;
+  }
+  if (!workers.admit()) {
+    connection.output = workers.busyReply();
+    return false;
+  }
+  connection.busy = true;
+  return true;
+}
+
+// The input and output files of a quantize or ladder task, for UringReactor
+std::unique_ptr<TaskFiles> taskFiles(const TaskOrError &task) {
+  auto files = std::make_unique<TaskFiles>();
+  std::vector<std::string> outputs;
+  if (std::holds_alternative<QuantizeTask>(task)) {
+    const auto &quantizeTask = std::get<QuantizeTask>(task);
+    files->inputPath = quantizeTask.imagePath;
+    outputs = {quantizeTask.quantizedImagePath};
+  } else if (std::holds_alternative<ScaleLadderTask>(task)) {
+    const auto &ladderTask = std::get<ScaleLadderTask>(task);
+    files->inputPath = ladderTask.imagePath;
+    outputs = ladderTask.resizedImagePaths;
+  }
+  files->task = task;
+  for (auto &path : outputs) {
+    TaskOutput output;
+    output.path = path;
+    files->outputs.push_back(std::move(output));
   }
+  return files;
+}
 
-  std::string buff(buffer, bytesRead);
-  return parseTask(buff);
+TaskFiles::~TaskFiles() {
+  for (auto &output : outputs) {
+    freeImageBuffer(&output.buffer);
+  }
 }
 
-bool processTask(TaskOrError task) {
+// Returns the reply for the client, "OK" optionally followed by
+// <key>=<value>: details about the run, or "Failed". With files the task
+// works on their bytes instead of the paths, see UringReactor.
+std::string processTask(TaskOrError task, TaskFiles *files) {
   bool status = true;
+  std::string details;
   if (std::holds_alternative<ScaleTask>(task)) {
     auto scaleTask = std::get<ScaleTask>(task);
-    status = status && scaleImage(scaleTask.imagePath.c_str(),
-                                  scaleTask.resizedImagePath.c_str(),
-                                  scaleTask.newWidth, scaleTask.newHeight);
+    ScaleReport report = {};
+    status = status && scaleImageWithOptions(scaleTask.imagePath.c_str(),
+                                             scaleTask.resizedImagePath.c_str(),
+                                             scaleTask.newWidth, scaleTask.newHeight,
+                                             &scaleTask.options, &report);
+    details = ":encode=" + std::string(encodeProfileName(report.encodeProfile)) +
+              ":encodeUs=" + std::to_string(report.encodeMicros) + ":";
   } else if (std::holds_alternative<QuantizeTask>(task)) {
     auto quantizeTask = std::get<QuantizeTask>(task);
-    status = status && quantizeImage(quantizeTask.imagePath.c_str(),
-                                     quantizeTask.quantizedImagePath.c_str(),
-                                     quantizeTask.levels);
+    QuantizeReport report = {};
+    if (files) {
+      status = status && quantizeImageBuffer(files->input.data(), files->inputSize,
+                                             quantizeTask.levels, &quantizeTask.options,
+                                             &files->outputs[0].buffer, &report);
+    } else {
+      status = status && quantizeImageWithOptions(
+                             quantizeTask.imagePath.c_str(),
+                             quantizeTask.quantizedImagePath.c_str(),
+                             quantizeTask.levels, &quantizeTask.options, &report);
+    }
+    details = ":iterations=" + std::to_string(report.iterations) +
+              ":converged=" + std::to_string(report.converged) +
+              ":encode=" + encodeProfileName(report.encodeProfile) +
+              ":encodeUs=" + std::to_string(report.encodeMicros) + ":";
+  } else if (std::holds_alternative<ScaleQuantizeTask>(task)) {
+    auto fusedTask = std::get<ScaleQuantizeTask>(task);
+    ScaleReport scaleReport = {};
+    QuantizeReport quantizeReport = {};
+    status = status && scaleQuantizeImage(
+                           fusedTask.imagePath.c_str(),
+                           fusedTask.resizedImagePath.c_str(),
+                           fusedTask.quantizedImagePath.c_str(),
+                           fusedTask.newWidth, fusedTask.newHeight, fusedTask.levels,
+                           &fusedTask.scaleOptions, &fusedTask.quantizeOptions,
+                           &scaleReport, &quantizeReport);
+    details = ":iterations=" + std::to_string(quantizeReport.iterations) +
+              ":converged=" + std::to_string(quantizeReport.converged) +
+              ":encode=" + encodeProfileName(quantizeReport.encodeProfile) +
+              ":scaleEncodeUs=" + std::to_string(scaleReport.encodeMicros) +
+              ":quantizeEncodeUs=" + std::to_string(quantizeReport.encodeMicros) +
+              ":";
+  } else if (std::holds_alternative<ScaleLadderTask>(task)) {
+    auto ladderTask = std::get<ScaleLadderTask>(task);
+    std::vector<ScaleTarget> targets;
+    for (size_t i = 0; i < ladderTask.sizes.size(); ++i) {
+      targets.push_back({ladderTask.resizedImagePaths[i].c_str(),
+                         ladderTask.sizes[i].first, ladderTask.sizes[i].second});
+    }
+    std::vector<ScaleReport> reports(targets.size());
+    if (files) {
+      std::vector<ImageBuffer> outputs(targets.size());
+      status = status && scaleImageLadderBuffer(files->input.data(), files->inputSize,
+                                                targets.data(), targets.size(),
+                                                &ladderTask.options, outputs.data(),
+                                                reports.data());
+      for (size_t i = 0; i < outputs.size(); ++i) {
+        files->outputs[i].buffer = outputs[i];
+      }
+    } else {
+      status = status && scaleImageLadder(ladderTask.imagePath.c_str(), targets.data(),
+                                          targets.size(), &ladderTask.options,
+                                          reports.data());
+    }
+    // Encodes run side by side, this is the time summed over all of them
+    long long encodeMicros = 0;
+    for (const auto &report : reports) {
+      encodeMicros += report.encodeMicros;
+    }
+    details = ":encode=" + std::string(encodeProfileName(ladderTask.options.encodeProfile)) +
+              ":encodeUs=" + std::to_string(encodeMicros) + ":";
+  }
+  return status ? "OK" + details : "Failed";
+}
+
+// Waiting tasks per worker thread at which new ones are refused by default
+constexpr size_t defaultBacklogPerThread = 4;
+
+// TASK_THREADS tasks run at once, one per core when unset.
+// QUEUE_HIGH_WATERMARK tasks may wait for them before new ones are refused,
+// defaultBacklogPerThread per thread when unset, and tasks are admitted
+// again once QUEUE_LOW_WATERMARK wait, half the high watermark when unset.
+WorkerLimits workerLimits() {
+  WorkerLimits limits;
+  const char *taskThreads = getenv("TASK_THREADS");
+  if (taskThreads && atoi(taskThreads) > 0) {
+    limits.threads = atoi(taskThreads);
+  } else {
+    limits.threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+
+  const char *highWatermark = getenv("QUEUE_HIGH_WATERMARK");
+  if (highWatermark && atoi(highWatermark) > 0) {
+    limits.highWatermark = atoi(highWatermark);
+  } else {
+    limits.highWatermark = limits.threads * defaultBacklogPerThread;
+  }
+  const char *lowWatermark = getenv("QUEUE_LOW_WATERMARK");
+  if (lowWatermark && atoi(lowWatermark) >= 0) {
+    limits.lowWatermark = atoi(lowWatermark);
+  } else {
+    limits.lowWatermark = limits.highWatermark / 2;
   }
-  return status;
+  limits.lowWatermark = std::min(limits.lowWatermark, limits.highWatermark - 1);
+  return limits;
 }
 
-bool sendResult(int clientSocket, std::string result) {
-  const char* buffer = result.c_str();
-  int bytesSent = send(clientSocket, buffer, sizeof(char) * sizeof(buffer), 0);
-  return bytesSent >= 0;
+TaskWorkers::TaskWorkers(const WorkerLimits &limits, int wakeup)
+    : limits(limits), wakeup(wakeup) {
+  for (size_t i = 0; i < limits.threads; ++i) {
+    threads.emplace_back(&TaskWorkers::run, this);
+  }
 }
 
-void handleClient(int clientSocket) {
+TaskWorkers::~TaskWorkers() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  ready.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// Tasks admitted and not running, whether waiting for a thread or, with
+// io_uring, for their input
+size_t TaskWorkers::backlog() const {
+  size_t active = running;
+  return admitted > active ? admitted - active : 0;
+}
+
+// Whether the reactor may take on another task, it then owes a submit or a
+// release for it
+bool TaskWorkers::admit() {
+  size_t waiting = backlog();
+  if (shedding && waiting <= limits.lowWatermark) {
+    shedding = false;
+  } else if (!shedding && waiting >= limits.highWatermark) {
+    shedding = true;
+  }
+  if (shedding) {
+    return false;
+  }
+  ++admitted;
+  return true;
+}
+
+// An admitted task that ended before it was submitted
+void TaskWorkers::release() {
+  --admitted;
+}
+
+void TaskWorkers::submit(Job job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(std::move(job));
+  }
+  ready.notify_one();
+}
+
+// The replies of the finished tasks, the successful ones followed by the
+// backlog left behind them so clients can back off before they are refused
+std::vector<Completion> TaskWorkers::takeCompletions() {
+  std::vector<Completion> taken;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    taken = std::move(completions);
+    completions.clear();
+  }
+  // Both drop together, the backlog only counts tasks no thread picked up
+  admitted -= taken.size();
+  running -= taken.size();
+  // Status replies show when the backlog drained, not the next admit
+  if (shedding && backlog() <= limits.lowWatermark) {
+    shedding = false;
+  }
+  for (auto &completion : taken) {
+    if (completion.reply.compare(0, 2, "OK") == 0) {
+      completion.reply += "queued=" + std::to_string(backlog()) + ":";
+    }
+  }
+  return taken;
+}
+
+// Shortest wait suggested to a refused client
+constexpr long long minRetryAfterMs = 100;
+
+// The reply to a refused task, with the time the workers need to get
+// through the backlog at the recent time per task
+std::string TaskWorkers::busyReply() const {
+  long long retryAfterMs = static_cast<long long>(backlog()) * averageMicros /
+                           static_cast<long long>(limits.threads) / 1000;
+  return "Busy:retryAfterMs=" +
+         std::to_string(std::max(retryAfterMs, minRetryAfterMs)) +
+         ":queued=" + std::to_string(backlog()) + ":";
+}
+
+// The reply to a status task
+std::string TaskWorkers::statusReply() const {
+  return "OK:queued=" + std::to_string(backlog()) +
+         ":running=" + std::to_string(running) +
+         ":threads=" + std::to_string(limits.threads) +
+         ":highWatermark=" + std::to_string(limits.highWatermark) +
+         ":lowWatermark=" + std::to_string(limits.lowWatermark) +
+         ":shedding=" + std::to_string(shedding) + ":";
+}
+
+void TaskWorkers::run() {
+  while (1) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      ready.wait(lock, [&] { return stopping || !jobs.empty(); });
+      if (jobs.empty()) {
+        return;
+      }
+      job = std::move(jobs.front());
+      jobs.pop_front();
+      ++running;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Completion completion{job.connection, "Failed", job.files};
+    // A task that throws fails alone, every client shares this process
+    try {
+      completion.reply = processTask(std::move(job.task), job.files);
+    } catch (const std::exception &e) {
+      fprintf(stderr, "Error: task failed: %s\n", e.what());
+    } catch (...) {
+      fprintf(stderr, "Error: task failed with an unknown exception\n");
+    }
+    long long micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      completions.push_back(std::move(completion));
+      long long average = averageMicros;
+      averageMicros = average == 0 ? micros : average + (micros - average) / 8;
+    }
+    uint64_t one = 1;
+    if (write(wakeup, &one, sizeof(one)) < 0) {
+      printf("Failed to wake the reactor\n");
+    }
+  }
+}
+
+EpollReactor::EpollReactor(int serverSocket, int epoll, int wakeup,
+                           const WorkerLimits &limits)
+    : serverSocket(serverSocket), epoll(epoll), wakeup(wakeup),
+      nextConnection(wakeupId + 1), workers(limits, wakeup) {}
+
+// Events or completions handled per wait
+constexpr int maxEvents = 256;
+
+void EpollReactor::run() {
+  struct epoll_event events[maxEvents];
+  while (1) {
+    int count = epoll_wait(epoll, events, maxEvents, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Failed to wait for events: %s\n", strerror(errno));
+      return;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      uint64_t id = events[i].data.u64;
+      if (id == listenerId) {
+        acceptConnections();
+      } else if (id == wakeupId) {
+        deliverCompletions();
+      } else {
+        // Hang ups and errors surface as a failed or empty read
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+          readConnection(id);
+        }
+        if (events[i].events & EPOLLOUT) {
+          writeConnection(id);
+        }
+      }
+    }
+  }
+}
+
+void EpollReactor::acceptConnections() {
   while (1) {
-    auto task = receiveTask(clientSocket);
+    int clientSocket = acceptConnection(serverSocket);
+    if (clientSocket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        printf("Failed to accept connection: %s\n", strerror(errno));
+      }
+      return;
+    }
 
-    if (std::holds_alternative<Error>(task)) {
-      printf("%s\n", std::get<Error>(task).c_str());
-      sendResult(clientSocket, std::get<Error>(task).c_str());
+    // Registered for reads and writes once, edge triggering only reports
+    // changes so a writable socket does not wake the loop again
+    uint64_t id = nextConnection++;
+    struct epoll_event event = {};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.u64 = id;
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, clientSocket, &event) < 0) {
+      close(clientSocket);
+      continue;
+    }
+    Connection connection;
+    connection.socket = clientSocket;
+    connections.emplace(id, std::move(connection));
+  }
+}
+
+// Largest task accepted, what a single recv used to take in
+constexpr size_t maxTaskBytes = 2048;
+
+void EpollReactor::readConnection(uint64_t id) {
+  auto it = connections.find(id);
+  if (it == connections.end()) {
+    return;
+  }
+  Connection &connection = it->second;
+
+  // Edge triggered, read until the socket is drained
+  char buffer[maxTaskBytes];
+  while (!connection.peerClosed) {
+    ssize_t bytesRead = recv(connection.socket, buffer, sizeof(buffer), 0);
+    if (bytesRead > 0) {
+      connection.input.append(buffer, bytesRead);
+      if (connection.input.size() > maxTaskBytes) {
+        printf("Task too long\n");
+        closeConnection(id);
+        return;
+      }
+    } else if (bytesRead == 0) {
+      printf("Client disconnected\n");
+      connection.peerClosed = true;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
       break;
+    } else if (errno != EINTR) {
+      printf("Failed to receive task\n");
+      closeConnection(id);
+      return;
     }
+  }
+  writeConnection(id);
+}
 
-    bool status = processTask(task);
+// Sends what the socket takes of the pending reply, then moves on to the
+// task received meanwhile. A reply left over is finished on EPOLLOUT.
+void EpollReactor::writeConnection(uint64_t id) {
+  auto it = connections.find(id);
+  if (it == connections.end()) {
+    return;
+  }
+  Connection &connection = it->second;
 
-    status = sendResult(clientSocket, status ? "OK" : "Failed");
+  while (1) {
+    while (!connection.output.empty()) {
+      ssize_t bytesSent = send(connection.socket, connection.output.data(),
+                               connection.output.size(), MSG_NOSIGNAL);
+      if (bytesSent >= 0) {
+        connection.output.erase(0, bytesSent);
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      } else if (errno != EINTR) {
+        printf("Failed to send result\n");
+        closeConnection(id);
+        return;
+      }
+    }
+    if (connection.closeAfterReply) {
+      closeConnection(id);
+      return;
+    }
 
-    if (!status) {
-      printf("Failed to send result\n");
+    // An error reply is ready right away, send it too
+    dispatch(id, connection);
+    if (connection.output.empty()) {
       break;
     }
   }
-  close(clientSocket);
+
+  if (connection.peerClosed && !connection.busy) {
+    closeConnection(id);
+  }
+}
+
+// Hands the received task to the workers unless takeTask answers it
+void EpollReactor::dispatch(uint64_t id, Connection &connection) {
+  if (connection.busy || !connection.output.empty() || connection.input.empty()) {
+    return;
+  }
+  TaskOrError task;
+  if (takeTask(connection, workers, task)) {
+    workers.submit(Job{id, std::move(task), NULL});
+  }
+}
+
+void EpollReactor::deliverCompletions() {
+  uint64_t count;
+  if (read(wakeup, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    printf("Failed to read the wakeup: %s\n", strerror(errno));
+  }
+
+  for (auto &completion : workers.takeCompletions()) {
+    auto it = connections.find(completion.connection);
+    if (it == connections.end()) {
+      // The client went away while its task ran
+      continue;
+    }
+    it->second.busy = false;
+    it->second.output = std::move(completion.reply);
+    writeConnection(completion.connection);
+  }
+}
+
+void EpollReactor::closeConnection(uint64_t id) {
+  auto it = connections.find(id);
+  if (it == connections.end()) {
+    return;
+  }
+  close(it->second.socket);
+  connections.erase(it);
+}
+
+IoUring::~IoUring() {
+  if (bufferRing != MAP_FAILED) {
+    munmap(bufferRing, bufferRingSize);
+  }
+  if (sqes != MAP_FAILED) {
+    munmap(sqes, sqesSize);
+  }
+  if (rings != MAP_FAILED) {
+    munmap(rings, ringsSize);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+// Operations UringReactor submits. Multishot recv has no probe flag of its
+// own, it came with the same kernel as IORING_OP_SEND_ZC.
+constexpr int uringOperations[] = {IORING_OP_ACCEPT, IORING_OP_RECV,   IORING_OP_SEND,
+                                   IORING_OP_OPENAT, IORING_OP_READ,   IORING_OP_WRITE,
+                                   IORING_OP_CLOSE,  IORING_OP_SEND_ZC};
+
+// Maps the rings, false when the kernel lacks io_uring or any of the
+// operations and features UringReactor relies on
+bool IoUring::open(unsigned entries, unsigned completions) {
+  struct io_uring_params params = {};
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = completions;
+  fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    return false;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_NODROP)) {
+    return false;
+  }
+
+  ringsSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                       params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  rings = mmap(NULL, ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               fd, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED) {
+    return false;
+  }
+  sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+  sqes = static_cast<io_uring_sqe *>(mmap(NULL, sqesSize, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, fd,
+                                          IORING_OFF_SQES));
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+
+  char *base = static_cast<char *>(rings);
+  sqHead = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+  sqTail = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+  sqMask = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+  sqEntries = params.sq_entries;
+  sqArray = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+  cqHead = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+  cqTail = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+  cqMask = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+
+  // io_uring_probe is followed by one io_uring_probe_op per operation
+  constexpr unsigned probeOperations = 256;
+  std::vector<io_uring_probe_op> probeMemory(probeOperations + 2);
+  auto *probe = reinterpret_cast<io_uring_probe *>(probeMemory.data());
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+              probeOperations) < 0) {
+    return false;
+  }
+  for (int operation : uringOperations) {
+    if (operation >= probe->ops_len ||
+        !(probe->ops[operation].flags & IO_URING_OP_SUPPORTED)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A cleared submission entry for opcode on fd, queued for the next submit.
+// A full queue is submitted first.
+io_uring_sqe *IoUring::prepare(int opcode, int fd, uint64_t userData) {
+  unsigned tail = *sqTail;
+  while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+    submit(false);
+  }
+  unsigned index = tail & sqMask;
+  io_uring_sqe *sqe = &sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = userData;
+  sqArray[index] = index;
+  // The kernel only reads the entries in io_uring_enter, the caller still
+  // fills in the rest
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++sqPending;
+  return sqe;
+}
+
+// Hands the queued entries to the kernel in one io_uring_enter, which also
+// waits for a completion when wait is set. Returns -errno on failure
+int IoUring::submit(bool wait) {
+  int submitted = syscall(__NR_io_uring_enter, fd, sqPending, wait ? 1 : 0,
+                          wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (submitted < 0) {
+    return -errno;
+  }
+  sqPending -= submitted;
+  return submitted;
+}
+
+// Copies up to max completions to out and frees their slots
+unsigned IoUring::takeCompletions(io_uring_cqe *out, unsigned max) {
+  unsigned head = *cqHead;
+  unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  unsigned count = 0;
+  while (head != tail && count < max) {
+    out[count++] = cqes[head++ & cqMask];
+  }
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+// count buffers of size bytes for the kernel to fill on requests with
+// IOSQE_BUFFER_SELECT in group. count is a power of two.
+bool IoUring::registerBuffers(unsigned short group, unsigned count, unsigned size) {
+  bufferRingSize = count * sizeof(io_uring_buf);
+  void *memory = mmap(NULL, bufferRingSize, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  bufferRing = static_cast<io_uring_buf_ring *>(memory);
+  // Compiled as C++ the bufs member starts after an empty struct instead of
+  // at the start of the ring, where the kernel reads the entries
+  bufferEntries = static_cast<io_uring_buf *>(memory);
+
+  struct io_uring_buf_reg registration = {};
+  registration.ring_addr = reinterpret_cast<uint64_t>(bufferRing);
+  registration.ring_entries = count;
+  registration.bgid = group;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &registration,
+              1) < 0) {
+    return false;
+  }
+
+  bufferCount = count;
+  bufferSize = size;
+  bufferMemory.resize(static_cast<size_t>(count) * size);
+  for (unsigned i = 0; i < count; ++i) {
+    returnBuffer(i);
+  }
+  return true;
+}
+
+const char *IoUring::buffer(unsigned short id) const {
+  return &bufferMemory[static_cast<size_t>(id) * bufferSize];
+}
+
+// Gives a buffer the kernel filled back to it
+void IoUring::returnBuffer(unsigned short id) {
+  unsigned short tail = bufferRing->tail;
+  io_uring_buf *entry = &bufferEntries[tail & (bufferCount - 1)];
+  entry->addr = reinterpret_cast<uint64_t>(buffer(id));
+  entry->len = bufferSize;
+  entry->bid = id;
+  __atomic_store_n(&bufferRing->tail, static_cast<unsigned short>(tail + 1),
+                   __ATOMIC_RELEASE);
+}
+
+// Submission entries of the ring. Completions are sized for a burst on
+// thousands of clients, the kernel keeps any overflow until they are taken.
+constexpr unsigned uringEntries = 256;
+constexpr unsigned uringCompletions = 16384;
+
+// Receive buffers of the ring, one holds the largest task
+constexpr unsigned short receiveBufferGroup = 0;
+constexpr unsigned receiveBuffers = 1024;
+constexpr unsigned receiveBufferSize = maxTaskBytes;
+
+// First read of an input file, doubled until the file fits
+constexpr size_t inputReadBytes = 1 << 20;
+
+// What a completion of UringReactor is for, in the top byte of its
+// user_data. The rest holds the connection, or for files the task above
+// uringTaskShift and the output below it.
+enum UringEvent : uint64_t {
+  URING_ACCEPT = 1,
+  URING_WAKEUP,
+  URING_RECEIVE,
+  URING_SEND,
+  URING_OPEN_INPUT,
+  URING_READ_INPUT,
+  URING_CLOSE_INPUT,
+  URING_OPEN_OUTPUT,
+  URING_WRITE_OUTPUT,
+  URING_CLOSE_OUTPUT
+};
+constexpr int uringEventShift = 56;
+constexpr int uringTaskShift = 16;
+
+uint64_t uringData(UringEvent event, uint64_t id) {
+  return static_cast<uint64_t>(event) << uringEventShift | id;
+}
+
+uint64_t uringFileData(UringEvent event, uint64_t task, size_t output) {
+  return uringData(event, task << uringTaskShift | output);
+}
+
+UringReactor::UringReactor(int serverSocket, IoUring &ring, int wakeup,
+                           const WorkerLimits &limits)
+    : serverSocket(serverSocket), ring(ring), wakeup(wakeup), nextConnection(1),
+      workers(limits, wakeup) {}
+
+void UringReactor::run() {
+  armAccept();
+  armWakeup();
+  io_uring_cqe completions[maxEvents];
+  while (1) {
+    // Submitting and waiting is the one system call per round
+    int result = ring.submit(true);
+    if (result < 0 && result != -EINTR) {
+      printf("Failed to wait for completions: %s\n", strerror(-result));
+      return;
+    }
+
+    unsigned count;
+    while ((count = ring.takeCompletions(completions, maxEvents)) > 0) {
+      for (unsigned i = 0; i < count; ++i) {
+        handle(completions[i]);
+      }
+    }
+  }
+}
+
+void UringReactor::handle(const io_uring_cqe &completion) {
+  uint64_t id = completion.user_data & ((uint64_t(1) << uringEventShift) - 1);
+  auto event = static_cast<UringEvent>(completion.user_data >> uringEventShift);
+  switch (event) {
+  case URING_ACCEPT:
+    if (completion.res >= 0) {
+      accepted(completion.res);
+    } else {
+      printf("Failed to accept connection: %s\n", strerror(-completion.res));
+    }
+    if (!(completion.flags & IORING_CQE_F_MORE)) {
+      armAccept();
+    }
+    return;
+  case URING_WAKEUP:
+    deliverCompletions();
+    armWakeup();
+    return;
+  case URING_RECEIVE:
+    received(id, completion);
+    return;
+  case URING_SEND:
+    sent(id, completion.res);
+    return;
+  default:
+    break;
+  }
+
+  // File of a task, which is gone when the input was closed after it failed
+  auto it = tasks.find(id >> uringTaskShift);
+  if (it == tasks.end()) {
+    return;
+  }
+  TaskFiles &files = *it->second;
+  size_t output = id & ((uint64_t(1) << uringTaskShift) - 1);
+  switch (event) {
+  case URING_OPEN_INPUT:
+    inputOpened(files, completion.res);
+    break;
+  case URING_READ_INPUT:
+    inputRead(files, completion.res);
+    break;
+  case URING_OPEN_OUTPUT:
+    outputOpened(files, output, completion.res);
+    break;
+  case URING_WRITE_OUTPUT:
+    outputWritten(files, output, completion.res);
+    break;
+  case URING_CLOSE_OUTPUT:
+    outputClosed(files, completion.res);
+    break;
+  default:
+    break;
+  }
+}
+
+void UringReactor::armAccept() {
+  io_uring_sqe *sqe =
+      ring.prepare(IORING_OP_ACCEPT, serverSocket, uringData(URING_ACCEPT, 0));
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+// One request delivering every read into a buffer of the ring until it fails
+// or the client closes
+void UringReactor::armReceive(uint64_t id, Connection &connection) {
+  io_uring_sqe *sqe = ring.prepare(IORING_OP_RECV, connection.socket,
+                                   uringData(URING_RECEIVE, id));
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = receiveBufferGroup;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  connection.receiving = true;
+}
+
+void UringReactor::armWakeup() {
+  io_uring_sqe *sqe = ring.prepare(IORING_OP_READ, wakeup, uringData(URING_WAKEUP, 0));
+  sqe->addr = reinterpret_cast<uint64_t>(&wakeupCount);
+  sqe->len = sizeof(wakeupCount);
+}
+
+void UringReactor::accepted(int clientSocket) {
+  uint64_t id = nextConnection++;
+  Connection connection;
+  connection.socket = clientSocket;
+  armReceive(id, connections.emplace(id, std::move(connection)).first->second);
+}
+
+void UringReactor::received(uint64_t id, const io_uring_cqe &completion) {
+  auto it = connections.find(id);
+  if (completion.flags & IORING_CQE_F_BUFFER) {
+    unsigned short buffer = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+    if (it != connections.end() && completion.res > 0) {
+      it->second.input.append(ring.buffer(buffer), completion.res);
+    }
+    ring.returnBuffer(buffer);
+  }
+  if (it == connections.end()) {
+    return;
+  }
+  Connection &connection = it->second;
+  if (!(completion.flags & IORING_CQE_F_MORE)) {
+    connection.receiving = false;
+  }
+  if (connection.closing) {
+    closeConnection(id);
+    return;
+  }
+
+  if (completion.res == 0) {
+    printf("Client disconnected\n");
+    connection.peerClosed = true;
+  } else if (completion.res < 0 && completion.res != -ENOBUFS) {
+    printf("Failed to receive task\n");
+    closeConnection(id);
+    return;
+  }
+  if (connection.input.size() > maxTaskBytes) {
+    printf("Task too long\n");
+    closeConnection(id);
+    return;
+  }
+  // Running out of buffers ends the request, the next one gets them back
+  if (!connection.receiving && !connection.peerClosed) {
+    armReceive(id, connection);
+  }
+  writeConnection(id);
+}
+
+void UringReactor::sent(uint64_t id, int result) {
+  auto it = connections.find(id);
+  if (it == connections.end()) {
+    return;
+  }
+  Connection &connection = it->second;
+  connection.sending = false;
+  if (connection.closing) {
+    closeConnection(id);
+    return;
+  }
+  if (result < 0) {
+    printf("Failed to send result\n");
+    closeConnection(id);
+    return;
+  }
+  connection.output.erase(0, result);
+  writeConnection(id);
+}
+
+// Sends the pending reply, or moves on to the task received meanwhile. Only
+// one send is in flight per connection, output stays put until it is done.
+void UringReactor::writeConnection(uint64_t id) {
+  auto it = connections.find(id);
+  if (it == connections.end()) {
+    return;
+  }
+  Connection &connection = it->second;
+  if (connection.sending || connection.closing) {
+    return;
+  }
+
+  if (connection.output.empty()) {
+    if (connection.closeAfterReply) {
+      closeConnection(id);
+      return;
+    }
+    dispatch(id, connection);
+  }
+  if (!connection.output.empty()) {
+    io_uring_sqe *sqe =
+        ring.prepare(IORING_OP_SEND, connection.socket, uringData(URING_SEND, id));
+    sqe->addr = reinterpret_cast<uint64_t>(connection.output.data());
+    sqe->len = connection.output.size();
+    sqe->msg_flags = MSG_NOSIGNAL;
+    connection.sending = true;
+    return;
+  }
+
+  if (connection.peerClosed && !connection.busy) {
+    closeConnection(id);
+  }
+}
+
+// Starts the received task by opening its input unless takeTask answers it
+void UringReactor::dispatch(uint64_t id, Connection &connection) {
+  if (connection.busy || !connection.output.empty() || connection.input.empty()) {
+    return;
+  }
+  TaskOrError task;
+  if (!takeTask(connection, workers, task)) {
+    return;
+  }
+  // Scale paths do their own blocking file I/O on the worker
+  if (std::holds_alternative<ScaleTask>(task) ||
+      std::holds_alternative<ScaleQuantizeTask>(task)) {
+    workers.submit(Job{id, std::move(task), NULL});
+    return;
+  }
+  auto files = taskFiles(task);
+  files->id = nextTask++;
+  files->connection = id;
+  TaskFiles &started = *files;
+  tasks.emplace(started.id, std::move(files));
+  openInput(started);
+}
+
+void UringReactor::openInput(TaskFiles &files) {
+  io_uring_sqe *sqe = ring.prepare(IORING_OP_OPENAT, AT_FDCWD,
+                                   uringFileData(URING_OPEN_INPUT, files.id, 0));
+  sqe->addr = reinterpret_cast<uint64_t>(files.inputPath.c_str());
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+void UringReactor::readInput(TaskFiles &files) {
+  io_uring_sqe *sqe = ring.prepare(IORING_OP_READ, files.inputFd,
+                                   uringFileData(URING_READ_INPUT, files.id, 0));
+  sqe->addr = reinterpret_cast<uint64_t>(files.input.data() + files.inputSize);
+  sqe->len = files.input.size() - files.inputSize;
+  sqe->off = files.inputSize;
+}
+
+void UringReactor::inputOpened(TaskFiles &files, int result) {
+  if (result < 0) {
+    fprintf(stderr, "Error: %s could not be opened for reading: %s\n",
+            files.inputPath.c_str(), strerror(-result));
+    files.failed = true;
+    finishTask(files);
+    return;
+  }
+  files.inputFd = result;
+  files.input.resize(inputReadBytes);
+  readInput(files);
+}
+
+// Reads until the end of the file, then hands the task to the workers
+void UringReactor::inputRead(TaskFiles &files, int result) {
+  if (result > 0) {
+    files.inputSize += result;
+    if (files.inputSize == files.input.size()) {
+      files.input.resize(files.input.size() * 2);
+    }
+    readInput(files);
+    return;
+  }
+
+  ring.prepare(IORING_OP_CLOSE, files.inputFd,
+               uringFileData(URING_CLOSE_INPUT, files.id, 0));
+  files.inputFd = -1;
+  if (result < 0) {
+    fprintf(stderr, "Error: failed to read %s: %s\n", files.inputPath.c_str(),
+            strerror(-result));
+    files.failed = true;
+    finishTask(files);
+    return;
+  }
+  files.submitted = true;
+  workers.submit(Job{files.connection, std::move(files.task), &files});
+}
+
+// Writes the outputs of the tasks the workers finished, or answers right
+// away when a task failed or wrote its own files
+void UringReactor::deliverCompletions() {
+  for (auto &completion : workers.takeCompletions()) {
+    if (!completion.files) {
+      answer(completion.connection, std::move(completion.reply));
+      continue;
+    }
+    TaskFiles &files = *completion.files;
+    files.reply = std::move(completion.reply);
+    if (files.reply.compare(0, 2, "OK") != 0) {
+      files.failed = true;
+      finishTask(files);
+      continue;
+    }
+    files.pendingOutputs = files.outputs.size();
+    for (size_t i = 0; i < files.outputs.size(); ++i) {
+      openOutput(files, i);
+    }
+  }
+}
+
+void UringReactor::openOutput(TaskFiles &files, size_t index) {
+  io_uring_sqe *sqe = ring.prepare(IORING_OP_OPENAT, AT_FDCWD,
+                                   uringFileData(URING_OPEN_OUTPUT, files.id, index));
+  sqe->addr = reinterpret_cast<uint64_t>(files.outputs[index].path.c_str());
+  sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  sqe->len = 0666;
+}
+
+// Writes what is left of the output, closing it once all is written
+void UringReactor::writeOutput(TaskFiles &files, size_t index) {
+  TaskOutput &output = files.outputs[index];
+  if (output.written == output.buffer.size) {
+    ring.prepare(IORING_OP_CLOSE, output.fd,
+                 uringFileData(URING_CLOSE_OUTPUT, files.id, index));
+    output.fd = -1;
+    return;
+  }
+  io_uring_sqe *sqe = ring.prepare(IORING_OP_WRITE, output.fd,
+                                   uringFileData(URING_WRITE_OUTPUT, files.id, index));
+  sqe->addr = reinterpret_cast<uint64_t>(output.buffer.data + output.written);
+  sqe->len = output.buffer.size - output.written;
+  sqe->off = output.written;
+}
+
+void UringReactor::outputOpened(TaskFiles &files, size_t index, int result) {
+  if (result < 0) {
+    fprintf(stderr, "Error: %s could not be opened for writing: %s\n",
+            files.outputs[index].path.c_str(), strerror(-result));
+    files.failed = true;
+    if (--files.pendingOutputs == 0) {
+      finishTask(files);
+    }
+    return;
+  }
+  files.outputs[index].fd = result;
+  writeOutput(files, index);
+}
+
+void UringReactor::outputWritten(TaskFiles &files, size_t index, int result) {
+  TaskOutput &output = files.outputs[index];
+  if (result <= 0) {
+    fprintf(stderr, "Error: failed to write %s: %s\n", output.path.c_str(),
+            strerror(result < 0 ? -result : EIO));
+    files.failed = true;
+    // Closed without the rest, outputClosed still counts it
+    output.written = output.buffer.size;
+  } else {
+    output.written += result;
+  }
+  writeOutput(files, index);
+}
+
+// Network storage may only report a failed write on close
+void UringReactor::outputClosed(TaskFiles &files, int result) {
+  if (result < 0) {
+    fprintf(stderr, "Error: failed to write PNG: %s\n", strerror(-result));
+    files.failed = true;
+  }
+  if (--files.pendingOutputs == 0) {
+    finishTask(files);
+  }
+}
+
+// Queues the reply of the task once every file of it is done
+void UringReactor::finishTask(TaskFiles &files) {
+  if (!files.submitted) {
+    workers.release();
+  }
+  uint64_t id = files.connection;
+  std::string reply = files.failed ? "Failed" : std::move(files.reply);
+  tasks.erase(files.id);
+  answer(id, std::move(reply));
+}
+
+// Queues the reply to the task of connection id
+void UringReactor::answer(uint64_t id, std::string reply) {
+  auto it = connections.find(id);
+  if (it == connections.end()) {
+    // The client went away while its task ran
+    return;
+  }
+  it->second.busy = false;
+  it->second.output = std::move(reply);
+  writeConnection(id);
+}
+
+// Shutting the socket down ends the requests still on it, it is closed once
+// their completions are in
+void UringReactor::closeConnection(uint64_t id) {
+  auto it = connections.find(id);
+  if (it == connections.end()) {
+    return;
+  }
+  Connection &connection = it->second;
+  if (!connection.closing) {
+    connection.closing = true;
+    shutdown(connection.socket, SHUT_RDWR);
+  }
+  if (connection.receiving || connection.sending) {
+    return;
+  }
+  close(connection.socket);
+  connections.erase(it);
+}
+
+// IO_BACKEND=epoll keeps to epoll, otherwise io_uring is used when the
+// kernel has everything UringReactor needs
+bool useUring() {
+  const char *backend = getenv("IO_BACKEND");
+  return !backend || strcmp(backend, "epoll") != 0;
 }
 
 int main() {
+  // WORKER_THREADS caps the threads one request can spread over, all cores
+  // when unset so a lone large request gets the whole machine. Task threads
+  // run iterations of their own loops and block once none are left.
+  WorkerLimits limits = workerLimits();
+  const char *workerThreads = getenv("WORKER_THREADS");
+  setWorkerThreads(workerThreads ? atoi(workerThreads) : 0);
+
+  // Every idle client holds a descriptor, allow as many as the hard limit
+  struct rlimit files;
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+
   int serverSocket = openSocket(8989);
   if (serverSocket < 0) {
     return -1;
   }
 
-  while (1) {
-    int clientSocket = acceptConnection(serverSocket);
-    if (clientSocket < 0) {
-      continue;
+  IoUring ring;
+  if (useUring() && ring.open(uringEntries, uringCompletions) &&
+      ring.registerBuffers(receiveBufferGroup, receiveBuffers, receiveBufferSize)) {
+    // The ring reads the wakeup, it waits there instead of failing when empty
+    int wakeup = eventfd(0, EFD_CLOEXEC);
+    if (wakeup < 0) {
+      return -1;
     }
+    printf("Serving with io_uring\n");
+    UringReactor reactor(serverSocket, ring, wakeup, limits);
+    reactor.run();
+    close(wakeup);
+    close(serverSocket);
+    return 0;
+  }
+
+  int wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeup < 0) {
+    return -1;
+  }
 
-    auto thread = std::thread(handleClient, clientSocket);
-    thread.detach();
+  int epoll = openEventLoop(serverSocket, wakeup);
+  if (epoll < 0) {
+    return -1;
   }
 
+  printf("Serving with epoll\n");
+  EpollReactor reactor(serverSocket, epoll, wakeup, limits);
+  reactor.run();
+
+  close(epoll);
+  close(wakeup);
   close(serverSocket);
 
   return 0;
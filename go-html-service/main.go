@@ -7,6 +7,7 @@ import (
 	"net"
 	"net/http"
 	"os"
+	"strconv"
 	"strings"
 	"time"
     "net/url"
@@ -141,6 +142,18 @@ func createFileName(name, originalFileName string) string {
 	return fmt.Sprintf("%s%s-%s-%s.%s", uploadPath, name, randSeq(8), timeSuffix, extension)
 }
 
+// Whole seconds of the retryAfterMs field of a busy reply, rounded up
+func retryAfterSeconds(reply string) string {
+    for _, field := range strings.Split(reply, ":") {
+        if ms, found := strings.CutPrefix(field, "retryAfterMs="); found {
+            if millis, err := strconv.Atoi(ms); err == nil {
+                return strconv.Itoa((millis + 999) / 1000)
+            }
+        }
+    }
+    return "1"
+}
+
 func processImage(w http.ResponseWriter, r *http.Request, fileName string, client *redis.Client) {
     processingHost := imageProcessingHost
     processingPort := imageProcessingPort
@@ -162,17 +175,23 @@ func processImage(w http.ResponseWriter, r *http.Request, fileName string, clien
     scaledFileName := strings.Split(fileName, ".")[0] + "-scaled.png"
     quantizedFileName := strings.Split(fileName, ".")[0] + "-quantized.png"
     
-    scaleTask := fmt.Sprintf("s:%s:%s:%d:%d:", fileName, scaledFileName, imageScaleDimensionsX, imageScaleDimensionsY)
-    quantizeTask := fmt.Sprintf("q:%s:%s:%d:", scaledFileName, quantizedFileName, quantizeColors)
+    // One task writes both files, the quantizer works on the scaled pixels
+    // without reading scaledFileName back
+    scaleQuantizeTask := fmt.Sprintf("f:%s:%s:%s:%d:%d:%d:", fileName, scaledFileName, quantizedFileName,
+                                     imageScaleDimensionsX, imageScaleDimensionsY, quantizeColors)
 
     buf := make([]byte, 1024)
-    conn.Write([]byte(scaleTask))
-    conn.Read(buf)
-    taskSuccess := strings.Contains(string(buf), "OK")
-
-    conn.Write([]byte(quantizeTask))
-    conn.Read(buf)
-    taskSuccess = taskSuccess && strings.Contains(string(buf), "OK")
+    conn.Write([]byte(scaleQuantizeTask))
+    n, _ := conn.Read(buf)
+    reply := string(buf[:n])
+
+    // The service refuses tasks while its backlog is full, pass its hint on
+    if strings.HasPrefix(reply, "Busy:") {
+        w.Header().Set("Retry-After", retryAfterSeconds(reply))
+        http.Error(w, "Image processing is busy, retry later", http.StatusServiceUnavailable)
+        return
+    }
+    taskSuccess := strings.HasPrefix(reply, "OK")
 
     if !taskSuccess {
         http.Error(w, "Image processing failed", http.StatusInternalServerError)